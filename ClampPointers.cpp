@@ -13,11 +13,16 @@
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/User.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Operator.h"
+#include "llvm/DebugInfo.h"
+#include "llvm/DIBuilder.h"
 
 #include "llvm/Support/CallSite.h"
 #include "llvm/Support/raw_ostream.h"
@@ -25,12 +30,20 @@
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Analysis/MemoryDependenceAnalysis.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Support/BlockFrequency.h"
+#include "llvm/Support/Format.h"
 
 #include <vector>
 #include <map>
+#include <algorithm>
 #include <set>
 #include <iostream>
 #include <sstream>
+#include <fstream>
 #include <cstdio>
 #include <iterator>
 
@@ -42,6 +55,61 @@ RunUnsafeMode("allow-unsafe-exceptions",
         cl::desc("Will not change main() function signature allowing program to be ran. Adds main function arguments to safe exceptions list and allows calling external functions / extern variables."),
         cl::init(false), cl::Hidden);
 
+// Declares **-clamp-pointers-thread-local-locals** switch. Makes the static `__local` allocations thread local, so that a runtime running work-groups in parallel on threads (like FakeCL) gives each of them its own copy.
+static cl::opt<bool>
+ThreadLocalLocals("clamp-pointers-thread-local-locals",
+        cl::desc("Make static __local allocations thread local, for runtimes running each concurrent work-group on a thread of its own."),
+        cl::init(false));
+
+// Declares **-clamp-pointers-profile** switch. Makes every boundary check count how many times it runs and fails, see [CheckProfiler](#CheckProfiler).
+static cl::opt<bool>
+ProfileChecks("clamp-pointers-profile",
+        cl::desc("Count executions and failures of each boundary check in __clamp_profile_counters."),
+        cl::init(false));
+
+// Declares **-clamp-pointers-profile-use** switch. Reads a check profile written by FakeCL and adds branch weights to the checks.
+static cl::opt<std::string>
+ProfileUse("clamp-pointers-profile-use",
+        cl::desc("Add branch weights to boundary checks from a check profile."),
+        cl::value_desc("filename"), cl::init(""));
+
+// Declares **-clamp-pointers-telemetry** switch. Makes failing boundary checks record themselves for the runtime, see [CheckTelemetry](#CheckTelemetry).
+static cl::opt<bool>
+Telemetry("clamp-pointers-telemetry",
+        cl::desc("Record failing boundary checks in __clamp_telemetry_records."),
+        cl::init(false));
+
+// Declares **-clamp-pointers-telemetry-size** switch. Sets how many failures are recorded until the runtime reads them.
+static cl::opt<unsigned>
+TelemetrySize("clamp-pointers-telemetry-size",
+        cl::desc("Number of failures __clamp_telemetry_records holds."),
+        cl::init(1024));
+
+// Declares **-clamp-pointers-check-table** switch. Writes where each boundary check is in the source, see [checkLocation](#checkLocation).
+static cl::opt<std::string>
+CheckTable("clamp-pointers-check-table",
+        cl::desc("Write the id, function, source location and lowering of each boundary check to a file."),
+        cl::value_desc("filename"), cl::init(""));
+
+// Lowerings of a boundary check, see [CheckPlanner](#CheckPlanner)
+enum CheckStrategy { StrategyAuto, StrategyBranch, StrategyClamp };
+
+// Declares **-clamp-pointers-strategy** switch. Chooses how boundary checks are lowered.
+static cl::opt<CheckStrategy>
+Strategy("clamp-pointers-strategy",
+        cl::desc("How boundary checks are lowered:"),
+        cl::values(clEnumValN(StrategyBranch, "branch", "skip out of bounds accesses with branches (default)"),
+                   clEnumValN(StrategyClamp, "clamp", "redirect out of bounds accesses to a dummy location with selects"),
+                   clEnumValN(StrategyAuto, "auto", "choose for each access by estimated cost and hoist limits out of loops"),
+                   clEnumValEnd),
+        cl::init(StrategyBranch));
+
+// Declares **-clamp-pointers-check-report** switch. Prints how each boundary check is lowered and how often it is estimated to run.
+static cl::opt<bool>
+CheckReport("clamp-pointers-check-report",
+        cl::desc("Print the lowering and estimated executions of each boundary check to stderr."),
+        cl::init(false));
+
 
 // Fast assert macro, which will not dump stack-trace to make tests run faster.
 #define fast_assert( condition, message ) do {                       \
@@ -1088,7 +1156,9 @@ namespace WebCL {
         localAllocations = new GlobalVariable
           (M, getASAllocationsType(localAddressSpaceNumber), false, GlobalValue::InternalLinkage, 
            ConstantAggregateZero::get(getASAllocationsType(localAddressSpaceNumber)), 
-           "localAllocations", NULL, GlobalVariable::NotThreadLocal, localAddressSpaceNumber);
+           "localAllocations", NULL,
+           ThreadLocalLocals ? GlobalVariable::GeneralDynamicTLSModel : GlobalVariable::NotThreadLocal,
+           localAddressSpaceNumber);
       }
       return localAllocations;
     }
@@ -1895,7 +1965,12 @@ namespace WebCL {
 
   void addChecks(Value *ptrOperand, Instruction *inst, AreaLimitByValueMap &valLimits, const AreaLimitSetByAddressSpaceMap &asLimits, ValueSet &safeExceptions);
 
-  void createLimitCheck(Value *ptr, const AreaLimitSet &limits, Instruction *meminst);
+  class CheckProfiler;
+  class CheckTelemetry;
+  struct CheckPlan;
+  void createLimitCheck(Value *ptr, const AreaLimitSet &limits, Instruction *meminst,
+                        unsigned id, CheckProfiler &profiler, CheckTelemetry &telemetry, const CheckPlan &plan,
+                        const DebugLoc &location);
 
   void convertCallToUseSmartPointerArgs(CallInst *call, Function *newFun,
                                         const ArgumentMap &replacedArguments,
@@ -2729,6 +2804,708 @@ namespace WebCL {
   }
   
  
+  // returns the file, line and column of the instruction, or an empty
+  // file and zeros if it has no debug location
+  void sourceLocation(Instruction *inst, std::string &file, unsigned &line, unsigned &column) {
+    DebugLoc loc = inst->getDebugLoc();
+    file = "";
+    line = 0;
+    column = 0;
+    if (!loc.isUnknown()) {
+      line = loc.getLine();
+      column = loc.getCol();
+      file = DIScope(loc.getScope(inst->getContext())).getFilename();
+    }
+  }
+
+  // ## <a id="checkLocation"></a> Source locations of checks
+  //
+  // Without a debug location, check code would be attributed by sampling
+  // profilers to whatever line comes next. It gets the line of the access
+  // it guards instead, with column 0, which no access has, in a lexical
+  // block of its own for each check, so that samples of check code are
+  // told apart from the access and from other checks on the line.
+  // -clamp-pointers-check-table=<file> writes a line for each check once
+  // the pass is done, naming the function by its final symbol:
+  //
+  //     <id> <function> <file>:<line>:<column> <load|store> <branch|clamp>
+  //
+  // where the location is the access's.
+  class CheckLocator {
+  public:
+    CheckLocator(Module &M) :
+      builder(M) {
+    }
+
+    // gives the location of the code of check id guarding meminst
+    DebugLoc locate(unsigned id, Instruction *meminst, CheckStrategy strategy) {
+      if (!CheckTable.empty()) {
+        Entry entry;
+        entry.id = id;
+        entry.function = meminst->getParent()->getParent();
+        sourceLocation(meminst, entry.file, entry.line, entry.column);
+        entry.store = isa<StoreInst>(meminst);
+        entry.strategy = strategy;
+        entries.push_back(entry);
+      }
+
+      DebugLoc loc = meminst->getDebugLoc();
+      if (loc.isUnknown()) {
+        return loc;
+      }
+      LLVMContext &c = meminst->getContext();
+      DIScope scope(loc.getScope(c));
+      if (!scope.Verify() || scope.getFilename().empty()) {
+        return DebugLoc::get(loc.getLine(), 0, loc.getScope(c), loc.getInlinedAt(c));
+      }
+      DILexicalBlock block = builder.createLexicalBlock(scope, builder.createFile(scope.getFilename(), scope.getDirectory()),
+                                                        loc.getLine(), loc.getCol());
+      return DebugLoc::get(loc.getLine(), 0, block, loc.getInlinedAt(c));
+    }
+
+    // writes the table if requested, once the pass has given functions
+    // their final names. The builder creates no compile unit, which
+    // DIBuilder::finalize would need, and lexical blocks and files need
+    // no finalizing.
+    void finish() {
+      if (CheckTable.empty()) {
+        return;
+      }
+      std::string error;
+      raw_fd_ostream table(CheckTable.c_str(), error);
+      fast_assert(error.empty(), "Cannot write check table " + CheckTable + ": " + error);
+      table << "# id function file:line:column access lowering\n";
+      for (unsigned i = 0; i < entries.size(); i++) {
+        const Entry &entry = entries[i];
+        table << entry.id << " " << entry.function->getName() << " "
+              << (entry.file.empty() ? "?" : entry.file) << ":" << entry.line << ":" << entry.column << " "
+              << (entry.store ? "store" : "load") << " "
+              << (entry.strategy == StrategyClamp ? "clamp" : "branch") << "\n";
+      }
+    }
+
+  private:
+    struct Entry {
+      unsigned id;
+      Function *function;
+      std::string file;
+      unsigned line;
+      unsigned column;
+      bool store;
+      CheckStrategy strategy;
+    };
+
+    DIBuilder builder;
+    std::vector<Entry> entries;
+  };
+
+  // gives the instructions from first up to but not including end the
+  // location, unless they have one
+  void setCheckLocation(Instruction *first, Instruction *end, const DebugLoc &location) {
+    for (Instruction *inst = first; inst && inst != end; inst = inst->getNextNode()) {
+      if (inst->getDebugLoc().isUnknown()) {
+        inst->setDebugLoc(location);
+      }
+    }
+  }
+
+  // ## <a id="CheckProfiler"></a> Check profiling
+  //
+  // Every check has an id, given in module order so that building the same
+  // code the same way gives the same ids. With -clamp-pointers-profile
+  // each check increments its pair of counters in
+  // `[N x [2 x i64]] __clamp_profile_counters`: executions and failures.
+  // `__clamp_profile_checks` describes each check as `{ i8* function,
+  // i8* file, i32 line, i32 column, i32 is_store }` and the i32
+  // `__clamp_profile_check_count` holds N. FakeCL finds these in built
+  // programs and writes them as a profile, one check per line:
+  //
+  //     <id> <executions> <failures> <load|store> <function> <file>:<line>:<column>
+  //
+  // With -clamp-pointers-profile-use=<profile> the checks get branch
+  // weights from the profile, matched by id and function.
+  class CheckProfiler {
+  public:
+    CheckProfiler(Module &M, unsigned checkCount) :
+      M(M), c(M.getContext()), counters(NULL) {
+      if (ProfileChecks) {
+        ArrayType* countersType = ArrayType::get(ArrayType::get(Type::getInt64Ty(c), 2), checkCount);
+        counters = new GlobalVariable(M, countersType, false, GlobalValue::ExternalLinkage,
+                                      Constant::getNullValue(countersType), "__clamp_profile_counters");
+      }
+      if (!ProfileUse.empty()) {
+        readProfile(ProfileUse);
+      }
+    }
+
+    // counts an execution of check id before the instruction
+    void countCheck(unsigned id, Instruction *before) {
+      increment(id, 0, ConstantInt::get(Type::getInt64Ty(c), 1), before);
+    }
+
+    // counts a failure of check id at the end of its failure block
+    void countFailure(unsigned id, BasicBlock *failBlock) {
+      increment(id, 1, ConstantInt::get(Type::getInt64Ty(c), 1), failBlock->getTerminator());
+    }
+
+    bool enabled() const {
+      return counters != NULL;
+    }
+
+    // returns the share of executions of check id in F that failed in
+    // the profile, 0 if it has none
+    double failureRate(unsigned id, Function *F) const {
+      ProfileMap::const_iterator entry = profile.find(std::make_pair(F->getName().str(), id));
+      if (entry == profile.end() || entry->second.first == 0) {
+        return 0;
+      }
+      return std::min(1.0, double(entry->second.second) / entry->second.first);
+    }
+
+    // records the function and source location of the access check id guards
+    void describeCheck(unsigned id, Instruction *meminst) {
+      std::string file;
+      unsigned line;
+      unsigned column;
+      sourceLocation(meminst, file, line, column);
+      Type* i32 = Type::getInt32Ty(c);
+      Constant* fields[] = {
+        stringConstant(meminst->getParent()->getParent()->getName()),
+        stringConstant(file),
+        ConstantInt::get(i32, line),
+        ConstantInt::get(i32, column),
+        ConstantInt::get(i32, isa<StoreInst>(meminst))
+      };
+      descriptions.push_back(ConstantStruct::getAnon(c, fields));
+    }
+
+    // adds branch weights from the profile to a branch of check id whose
+    // true edge leads to failure
+    void addWeights(unsigned id, Function *F, BranchInst *branch) {
+      ProfileMap::const_iterator entry = profile.find(std::make_pair(F->getName().str(), id));
+      if (entry == profile.end()) {
+        return;
+      }
+      uint64_t executions = entry->second.first;
+      uint64_t failures = std::min(entry->second.second, executions);
+      // weights are 32 bits
+      while (executions > 0xffffffffULL) {
+        executions >>= 1;
+        failures >>= 1;
+      }
+      // the true edge comes first and is the failing one
+      branch->setMetadata(LLVMContext::MD_prof,
+                          MDBuilder(c).createBranchWeights(failures + 1, executions - failures + 1));
+    }
+
+    // creates the description table once all checks are described
+    void finish() {
+      if (!counters) {
+        return;
+      }
+      Type* i8Ptr = Type::getInt8PtrTy(c);
+      Type* i32 = Type::getInt32Ty(c);
+      StructType* descriptionType = StructType::get(i8Ptr, i8Ptr, i32, i32, i32, NULL);
+      ArrayType* tableType = ArrayType::get(descriptionType, descriptions.size());
+      new GlobalVariable(M, tableType, true, GlobalValue::ExternalLinkage,
+                         ConstantArray::get(tableType, descriptions), "__clamp_profile_checks");
+      new GlobalVariable(M, Type::getInt32Ty(c), true, GlobalValue::ExternalLinkage,
+                         ConstantInt::get(Type::getInt32Ty(c), descriptions.size()),
+                         "__clamp_profile_check_count");
+    }
+
+  private:
+    // executions and failures by function and check id
+    typedef std::map< std::pair<std::string, unsigned>, std::pair<uint64_t, uint64_t> > ProfileMap;
+
+    void readProfile(const std::string &path) {
+      std::ifstream in(path.c_str());
+      fast_assert(in.good(), "Cannot read check profile " + path);
+      std::string line;
+      while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        unsigned id;
+        uint64_t executions, failures;
+        std::string access, function;
+        if (line.empty() || line[0] == '#' || !(fields >> id >> executions >> failures >> access >> function)) {
+          continue;
+        }
+        std::pair<uint64_t, uint64_t>& counts = profile[std::make_pair(function, id)];
+        counts.first += executions;
+        counts.second += failures;
+      }
+    }
+
+    void increment(unsigned id, unsigned index, Value *amount, Instruction *before) {
+      if (counters) {
+        IRBuilder<> builder(before);
+        builder.CreateAtomicRMW(AtomicRMWInst::Add, counter(id, index), amount, Monotonic);
+      }
+    }
+
+    Constant* counter(unsigned id, unsigned index) {
+      Constant* indices[] = {
+        ConstantInt::get(Type::getInt32Ty(c), 0),
+        ConstantInt::get(Type::getInt32Ty(c), id),
+        ConstantInt::get(Type::getInt32Ty(c), index)
+      };
+      return ConstantExpr::getInBoundsGetElementPtr(counters, indices);
+    }
+
+    Constant* stringConstant(StringRef value) {
+      Constant* data = ConstantDataArray::getString(c, value);
+      GlobalVariable* string = new GlobalVariable(M, data->getType(), true, GlobalValue::PrivateLinkage,
+                                                  data, "clamp.profile.string");
+      return ConstantExpr::getPointerCast(string, Type::getInt8PtrTy(c));
+    }
+
+    Module &M;
+    LLVMContext &c;
+    GlobalVariable *counters;
+    std::vector<Constant*> descriptions;
+    ProfileMap profile;
+  };
+
+  // ## <a id="CheckTelemetry"></a> Recording check failures
+  //
+  // With -clamp-pointers-telemetry a failing check records itself in
+  // `__clamp_telemetry_records`, an array of `{ i32 check, [3 x i64]
+  // global id, i64 address, i64 first, i64 last }` giving the check id,
+  // the work-item, the accessed address and the first and last valid
+  // address for the access. It holds -clamp-pointers-telemetry-size
+  // records and one more, which failures beyond those overwrite.
+  // `i64 __clamp_telemetry_head` counts the failures, so the ones that
+  // did not fit are counted too. A slot is claimed with an atomic add and
+  // no locks are taken. The runtime reads and resets the records after a
+  // launch, see fakeclSetClampViolationHandler in tests/FakeCL.h.
+  class CheckTelemetry {
+  public:
+    CheckTelemetry(Module &M) :
+      M(M), c(M.getContext()), records(NULL), head(NULL), globalId(NULL) {
+      if (!Telemetry) {
+        return;
+      }
+      Type* i32 = Type::getInt32Ty(c);
+      Type* i64 = Type::getInt64Ty(c);
+      StructType* recordType = StructType::get(i32, ArrayType::get(i64, 3), i64, i64, i64, NULL);
+      ArrayType* recordsType = ArrayType::get(recordType, TelemetrySize + 1);
+      records = new GlobalVariable(M, recordsType, false, GlobalValue::ExternalLinkage,
+                                   Constant::getNullValue(recordsType), "__clamp_telemetry_records");
+      head = new GlobalVariable(M, i64, false, GlobalValue::ExternalLinkage,
+                                ConstantInt::get(i64, 0), "__clamp_telemetry_head");
+      new GlobalVariable(M, i32, true, GlobalValue::ExternalLinkage,
+                         ConstantInt::get(i32, TelemetrySize), "__clamp_telemetry_capacity");
+    }
+
+    bool enabled() const {
+      return records != NULL;
+    }
+
+    // records before the instruction that check id failed for ptr,
+    // whose valid addresses are from first to last
+    void recordFailure(unsigned id, Value *ptr, Value *first, Value *last, Instruction *before) {
+      if (!records) {
+        return;
+      }
+      Type* i64 = Type::getInt64Ty(c);
+      IRBuilder<> builder(before);
+      Value* capacity = ConstantInt::get(i64, TelemetrySize);
+      Value* slot = builder.CreateAtomicRMW(AtomicRMWInst::Add, head, ConstantInt::get(i64, 1), Monotonic);
+      Value* index = builder.CreateSelect(builder.CreateICmpULT(slot, capacity), slot, capacity);
+      Value* indices[] = { ConstantInt::get(i64, 0), index };
+      Value* record = builder.CreateInBoundsGEP(records, indices, "violation");
+
+      builder.CreateStore(ConstantInt::get(Type::getInt32Ty(c), id), builder.CreateStructGEP(record, 0));
+      Function* getGlobalId = globalIdFunction();
+      for (int dim = 0; dim < 3; dim++) {
+        Value* workItem = builder.CreateCall(getGlobalId, ConstantInt::get(getGlobalId->getFunctionType()->getParamType(0), dim));
+        builder.CreateStore(builder.CreateIntCast(workItem, i64, false),
+                            builder.CreateInBoundsGEP(record, genIntVector<Value*>(c, 0, 1, dim)));
+      }
+      builder.CreateStore(builder.CreatePtrToInt(ptr, i64), builder.CreateStructGEP(record, 2));
+      builder.CreateStore(builder.CreatePtrToInt(first, i64), builder.CreateStructGEP(record, 3));
+      builder.CreateStore(builder.CreatePtrToInt(last, i64), builder.CreateStructGEP(record, 4));
+    }
+
+  private:
+    // get_global_id, declared with size_t of the target if the module
+    // doesn't call it
+    Function* globalIdFunction() {
+      if (!globalId) {
+        globalId = M.getFunction("get_global_id");
+      }
+      if (!globalId) {
+        DataLayout dataLayout(&M);
+        FunctionType* type = FunctionType::get(Type::getIntNTy(c, dataLayout.getPointerSizeInBits()),
+                                               std::vector<Type*>(1, Type::getInt32Ty(c)), false);
+        globalId = Function::Create(type, GlobalValue::ExternalLinkage, "get_global_id", &M);
+      }
+      return globalId;
+    }
+
+    Module &M;
+    LLVMContext &c;
+    GlobalVariable *records;
+    GlobalVariable *head;
+    Function *globalId;
+  };
+
+  // ## <a id="CheckPlanner"></a> Choosing how checks are lowered
+  //
+  // A check either branches around the access when it is out of bounds
+  // (*branch*), or redirects the access to a dummy location with a select
+  // and makes a load return zero (*clamp*). Clamping adds no blocks, so
+  // loops stay simple enough for the optimizer to vectorize or unroll,
+  // but the access always runs. With -clamp-pointers-strategy=auto the
+  // cheaper of the two is chosen for each check by estimated cost, and
+  // the limits of checks in loops are computed in the preheader of the
+  // outermost loop, as far as alias analysis shows that nothing in the
+  // loop may write the memory they are read from.
+  //
+  // Costs are roughly instructions per execution. A branching check is
+  // two compares and two branches, plus the misprediction penalty times
+  // the share of executions that fail in the profile given with
+  // -clamp-pointers-profile-use, plus a penalty in loops that iterate
+  // enough to be worth vectorizing. A clamping check is two compares, an
+  // or and a select.
+  const double branchCheckCost = 4;
+  const double clampCheckCost = 5;
+  const double mispredictionCost = 20;
+  const double loopBranchCost = 2;
+  // iterations from which a loop is worth vectorizing
+  const double vectorizableIterations = 4;
+
+  // How a check is lowered, decided before any check is added
+  struct CheckPlan {
+    CheckStrategy strategy;    // StrategyBranch or StrategyClamp
+    Instruction *hoistPoint;   // limits are computed before this, or at the access if NULL
+    double executions;         // estimated per invocation of the function
+    unsigned loopDepth;
+    // instructions of the loop left at hoistPoint that may write memory
+    const std::vector<Instruction*> *loopWrites;
+    AliasAnalysis *AA;
+
+    CheckPlan(CheckStrategy strategy) :
+      strategy(strategy), hoistPoint(NULL), executions(1), loopDepth(0), loopWrites(NULL), AA(NULL) {
+    }
+
+    // whether load reads the same value before hoistPoint as in the loop
+    bool hoistable(LoadInst *load) const {
+      if (load->isVolatile() || !load->isUnordered()) {
+        return false;
+      }
+      AliasAnalysis::Location location = AA->getLocation(load);
+      for (unsigned i = 0; i < loopWrites->size(); i++) {
+        if (AA->getModRefInfo((*loopWrites)[i], location) & AliasAnalysis::Mod) {
+          return false;
+        }
+      }
+      return true;
+    }
+  };
+
+  // The function analyses CheckPlanner uses. A module pass asking for a
+  // function analysis reruns all the function passes it requires, so
+  // they come through this pass, asked for once for each function.
+  struct CheckEstimates :
+    public FunctionPass {
+    static char ID;
+    LoopInfo *LI;
+    BlockFrequencyInfo *BFI;
+    ScalarEvolution *SE;
+
+    CheckEstimates() :
+      FunctionPass(ID), LI(NULL), BFI(NULL), SE(NULL) {
+    }
+
+    virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+      AU.addRequired<LoopInfo>();
+      AU.addRequired<BlockFrequencyInfo>();
+      AU.addRequired<ScalarEvolution>();
+      AU.setPreservesAll();
+    }
+
+    virtual bool runOnFunction(Function &F) {
+      LI = &getAnalysis<LoopInfo>();
+      BFI = &getAnalysis<BlockFrequencyInfo>();
+      SE = &getAnalysis<ScalarEvolution>();
+      return false;
+    }
+  };
+
+  class CheckPlanner {
+  public:
+    CheckPlanner(Pass &pass, CheckProfiler &profiler) :
+      pass(pass), profiler(profiler),
+      defaultPlan(Strategy == StrategyClamp ? StrategyClamp : StrategyBranch) {
+    }
+
+    // whether plans need the analyses of the functions
+    static bool estimates() {
+      return Strategy == StrategyAuto || CheckReport;
+    }
+
+    // plans the given checks of F by their ids, before any check is added
+    void plan(Function &F, const std::vector<Instruction*> &checks, unsigned firstId) {
+      CheckEstimates &analyses = pass.getAnalysis<CheckEstimates>(F);
+      LoopInfo &LI = *analyses.LI;
+      BlockFrequencyInfo &BFI = *analyses.BFI;
+      ScalarEvolution &SE = *analyses.SE;
+      AliasAnalysis *AA = Strategy == StrategyAuto ? &pass.getAnalysis<AliasAnalysis>() : NULL;
+
+      FunctionEstimate &estimate = estimates_[&F];
+      for (unsigned i = 0; i < checks.size(); i++) {
+        unsigned id = firstId + i;
+        BasicBlock *BB = checks[i]->getParent();
+        CheckPlan plan = defaultPlan;
+        plan.executions = executions(BB, LI, BFI, SE);
+        plan.loopDepth = LI.getLoopDepth(BB);
+        if (Strategy == StrategyAuto) {
+          Loop *innermost = LI.getLoopFor(BB);
+          double branchCost = branchCheckCost + mispredictionCost * profiler.failureRate(id, &F);
+          if (innermost && iterations(innermost, BFI, SE) >= vectorizableIterations) {
+            branchCost += loopBranchCost;
+          }
+          plan.strategy = clampCheckCost < branchCost ? StrategyClamp : StrategyBranch;
+          Loop *outermost = NULL;
+          for (Loop *L = innermost; L; L = L->getParentLoop()) {
+            if (BasicBlock *preheader = L->getLoopPreheader()) {
+              plan.hoistPoint = preheader->getTerminator();
+              outermost = L;
+            }
+          }
+          if (outermost) {
+            plan.loopWrites = &writesIn(outermost, plan.hoistPoint);
+            plan.AA = AA;
+          }
+        }
+        plans.insert(std::make_pair(id, plan));
+        estimate.checks.push_back(std::make_pair(id, isa<StoreInst>(checks[i])));
+        estimate.executions += plan.executions;
+      }
+
+      for (Function::iterator BB = F.begin(); BB != F.end(); ++BB) {
+        for (BasicBlock::iterator I = BB->begin(); I != BB->end(); ++I) {
+          CallInst *call = dyn_cast<CallInst>(I);
+          Function *callee = call ? call->getCalledFunction() : NULL;
+          if (callee && !callee->isDeclaration()) {
+            estimate.calls.push_back(std::make_pair(callee, executions(BB, LI, BFI, SE)));
+          }
+        }
+      }
+    }
+
+    const CheckPlan& planFor(unsigned id) const {
+      std::map<unsigned, CheckPlan>::const_iterator plan = plans.find(id);
+      return plan != plans.end() ? plan->second : defaultPlan;
+    }
+
+    // prints each planned function with its checks, and the checks it is
+    // estimated to run in an invocation including those of the functions
+    // it calls
+    void report(Module &M, raw_ostream &out) {
+      out << "; boundary checks: id, access, lowering, loop depth and estimated executions per invocation\n";
+      for (Module::iterator F = M.begin(); F != M.end(); ++F) {
+        std::map<Function*, FunctionEstimate>::const_iterator estimate = estimates_.find(F);
+        if (estimate == estimates_.end()) {
+          continue;
+        }
+        out << F->getName() << ": " << format("%.1f", totalExecutions(F))
+            << " checks per invocation, " << format("%.1f", estimate->second.executions) << " in the function itself\n";
+        const std::vector< std::pair<unsigned, bool> > &checks = estimate->second.checks;
+        for (unsigned i = 0; i < checks.size(); i++) {
+          const CheckPlan &plan = planFor(checks[i].first);
+          out << "  " << checks[i].first << " " << (checks[i].second ? "store" : "load")
+              << " " << (plan.strategy == StrategyClamp ? "clamp" : "branch")
+              << (plan.hoistPoint ? " hoisted" : "")
+              << " depth " << plan.loopDepth << " " << format("%.1f", plan.executions) << "\n";
+        }
+      }
+    }
+
+  private:
+    // the instructions of L that may write memory, collected once for
+    // its preheader's terminator before checks split its blocks
+    const std::vector<Instruction*>& writesIn(Loop *L, Instruction *hoistPoint) {
+      std::map<Instruction*, std::vector<Instruction*> >::iterator known = writes.find(hoistPoint);
+      if (known != writes.end()) {
+        return known->second;
+      }
+      std::vector<Instruction*> &loopWrites = writes[hoistPoint];
+      for (Loop::block_iterator BB = L->block_begin(); BB != L->block_end(); ++BB) {
+        for (BasicBlock::iterator I = (*BB)->begin(); I != (*BB)->end(); ++I) {
+          if (I->mayWriteToMemory()) {
+            loopWrites.push_back(I);
+          }
+        }
+      }
+      return loopWrites;
+    }
+
+    struct FunctionEstimate {
+      // check ids, and whether they check stores
+      std::vector< std::pair<unsigned, bool> > checks;
+      // estimated executions of the function's own checks
+      double executions;
+      // defined functions called and estimated executions of each call
+      std::vector< std::pair<Function*, double> > calls;
+
+      FunctionEstimate() : executions(0) {}
+    };
+
+    // iterations of L each time it is entered: the trip count if scalar
+    // evolution knows it, otherwise as guessed from block frequencies
+    double iterations(Loop *L, BlockFrequencyInfo &BFI, ScalarEvolution &SE) {
+      BasicBlock *exiting = L->getExitingBlock();
+      unsigned tripCount = exiting ? SE.getSmallConstantTripCount(L, exiting) : 0;
+      if (tripCount) {
+        return tripCount;
+      }
+      return guessedIterations(L, BFI);
+    }
+
+    double guessedIterations(Loop *L, BlockFrequencyInfo &BFI) {
+      BasicBlock *preheader = L->getLoopPreheader();
+      double entries = preheader ? BFI.getBlockFreq(preheader).getFrequency() : 0;
+      return entries > 0 ? BFI.getBlockFreq(L->getHeader()).getFrequency() / entries : 1;
+    }
+
+    // estimated executions of BB per invocation of its function: its
+    // block frequency relative to the entry, with the guessed iterations
+    // of each loop around it replaced by known trip counts
+    double executions(BasicBlock *BB, LoopInfo &LI, BlockFrequencyInfo &BFI, ScalarEvolution &SE) {
+      double executions = double(BFI.getBlockFreq(BB).getFrequency()) / BlockFrequency::getEntryFrequency();
+      for (Loop *L = LI.getLoopFor(BB); L; L = L->getParentLoop()) {
+        executions *= iterations(L, BFI, SE) / guessedIterations(L, BFI);
+      }
+      return executions;
+    }
+
+    double totalExecutions(Function *F) {
+      std::map<Function*, double>::const_iterator known = totals.find(F);
+      if (known != totals.end()) {
+        return known->second;
+      }
+      // OpenCL C has no recursion, but don't loop forever if there is
+      totals[F] = 0;
+      double total = 0;
+      std::map<Function*, FunctionEstimate>::const_iterator estimate = estimates_.find(F);
+      if (estimate != estimates_.end()) {
+        total = estimate->second.executions;
+        const std::vector< std::pair<Function*, double> > &calls = estimate->second.calls;
+        for (unsigned i = 0; i < calls.size(); i++) {
+          total += calls[i].second * totalExecutions(calls[i].first);
+        }
+      }
+      totals[F] = total;
+      return total;
+    }
+
+    Pass &pass;
+    CheckProfiler &profiler;
+    CheckPlan defaultPlan;
+    std::map<unsigned, CheckPlan> plans;
+    std::map<Function*, FunctionEstimate> estimates_;
+    std::map<Function*, double> totals;
+    std::map<Instruction*, std::vector<Instruction*> > writes;
+  };
+
+  // Computes the limits of a check with validAddressBoundsFor at the
+  // access, and moves the instructions computing them before the
+  // plan's hoistPoint unless it is NULL. An instruction moves only if its
+  // operands are constants, arguments, instructions in the entry block
+  // or moved ones, and a load only if nothing in the loop may write
+  // what it reads.
+  void validAddressBounds(AreaLimitBase *limit, Type *type, Instruction *meminst, const CheckPlan &plan,
+                          const DebugLoc &location, Value *&first, Value *&last) {
+    Instruction *previous = meminst->getPrevNode();
+    limit->validAddressBoundsFor(type, meminst, first, last);
+    setCheckLocation(previous ? previous->getNextNode() : &meminst->getParent()->front(), meminst, location);
+    if (!plan.hoistPoint) {
+      return;
+    }
+    BasicBlock *entry = &meminst->getParent()->getParent()->getEntryBlock();
+    BasicBlock::iterator begin = previous ? BasicBlock::iterator(previous) : meminst->getParent()->begin();
+    if (previous) {
+      ++begin;
+    }
+    std::vector<Instruction*> created;
+    for (BasicBlock::iterator I = begin; &*I != meminst; ++I) {
+      created.push_back(I);
+    }
+    std::set<Instruction*> moved;
+    for (unsigned i = 0; i < created.size(); i++) {
+      LoadInst *load = dyn_cast<LoadInst>(created[i]);
+      bool invariant = load ? plan.hoistable(load) : !created[i]->mayHaveSideEffects();
+      for (User::op_iterator op = created[i]->op_begin(); op != created[i]->op_end(); ++op) {
+        Instruction *operand = dyn_cast<Instruction>(op->get());
+        invariant = invariant && (!operand || operand->getParent() == entry || moved.count(operand));
+      }
+      if (invariant) {
+        created[i]->moveBefore(plan.hoistPoint);
+        moved.insert(created[i]);
+      }
+    }
+  }
+
+  // Gives the location a failed access of type in F goes to, in the
+  // address space of the access. For private memory it is an alloca in
+  // the entry block, which each work-item has of its own. Other address
+  // spaces can't point to private memory, so they share an internal
+  // global of the module, one for each address space and type.
+  Value* clampSink(Function *F, PointerType *type) {
+    std::string sinkName = "clamp.sink";
+    if (type->getAddressSpace() == privateAddressSpaceNumber) {
+      BasicBlock &entry = F->getEntryBlock();
+      for (BasicBlock::iterator I = entry.begin(); I != entry.end(); ++I) {
+        if (isa<AllocaInst>(I) && I->getName().startswith(sinkName) && I->getType() == type) {
+          return I;
+        }
+      }
+      AllocaInst* sink = new AllocaInst(type->getElementType(), sinkName, entry.getFirstInsertionPt());
+      sink->setAlignment(16);
+      return sink;
+    }
+    Module *M = F->getParent();
+    for (Module::global_iterator g = M->global_begin(); g != M->global_end(); ++g) {
+      if (g->getName().startswith(sinkName) && g->getType() == type) {
+        return g;
+      }
+    }
+    GlobalVariable* sink = new GlobalVariable(*M, type->getElementType(), type->getAddressSpace() == constantAddressSpaceNumber,
+                                              GlobalValue::InternalLinkage,
+                                              Constant::getNullValue(type->getElementType()), sinkName,
+                                              NULL, GlobalVariable::NotThreadLocal, type->getAddressSpace());
+    sink->setAlignment(16);
+    return sink;
+  }
+
+  // Redirects an out of bounds access to a dummy location of the same
+  // address space, and makes an out of bounds load return zero. Returns
+  // whether the access failed the check.
+  Value* createClampCheck(Value *ptr, Value *first, Value *last, Instruction *meminst, const std::string &postfix) {
+    PointerType *type = cast<PointerType>(ptr->getType());
+
+    ICmpInst* above = new ICmpInst( meminst, CmpInst::ICMP_UGT, ptr, last, "" );
+    ICmpInst* below = new ICmpInst( meminst, CmpInst::ICMP_ULT, ptr, first, "" );
+    Value* failed = BinaryOperator::CreateOr(above, below, "boundary.check.failed." + postfix, meminst);
+
+    // a failed store goes here, a failed load reads from here
+    Value* sink = clampSink(meminst->getParent()->getParent(), type);
+    Value* clamped = SelectInst::Create(failed, sink, ptr, "clamped." + postfix, meminst);
+
+    if (LoadInst *load = dyn_cast<LoadInst>(meminst)) {
+      load->setOperand(LoadInst::getPointerOperandIndex(), clamped);
+      SelectInst* value = SelectInst::Create(failed, Constant::getNullValue(load->getType()), load, "");
+      value->insertAfter(load);
+      load->replaceAllUsesWith(value);
+      value->setOperand(2, load);
+    } else {
+      cast<StoreInst>(meminst)->setOperand(StoreInst::getPointerOperandIndex(), clamped);
+    }
+    return failed;
+  }
+
   /**
    * Adds boundary check for given pointer
    *
@@ -2761,18 +3538,25 @@ namespace WebCL {
    * @param ptr Address whose limits are checked
    * @param limits Smart pointer, whose limits pointer should respect
    * @param meminst Instruction which for check is injected
+   * ==== with the clamp strategy the access is redirected instead, see [CheckPlanner](#CheckPlanner)
+   *
+   * @param id Number of the check, unique in the module
+   * @param profiler Adds profiling to the check if requested
+   * @param telemetry Records failures of the check if requested
+   * @param plan How the check is lowered
+   * @param location Debug location of the check code, see [checkLocation](#checkLocation)
    */
-  void createLimitCheck(Value *ptr, const AreaLimitSet &limits, Instruction *meminst) {
+  void createLimitCheck(Value *ptr, const AreaLimitSet &limits, Instruction *meminst,
+                        unsigned id, CheckProfiler &profiler, CheckTelemetry &telemetry, const CheckPlan &plan,
+                        const DebugLoc &location) {
       
     DEBUG( dbgs() << "Creating limit check for: "; ptr->print(dbgs()); dbgs() << " of type: "; ptr->getType()->print(dbgs()); dbgs() << "\n" );
-    static int id = 0;
-    id++;
     char postfix_buf[64];
     
     if ( dyn_cast<LoadInst>(meminst) ) {
-      sprintf(postfix_buf, "load.%d", id);
+      sprintf(postfix_buf, "load.%u", id);
     } else {
-      sprintf(postfix_buf, "store.%d", id);
+      sprintf(postfix_buf, "store.%u", id);
     }
     std::string postfix = postfix_buf;
       
@@ -2786,6 +3570,37 @@ namespace WebCL {
     BasicBlock *BB = meminst->getParent();
     Function *F = BB->getParent();
     LLVMContext& c = F->getContext();
+    Instruction *previous = meminst->getPrevNode();
+
+    if (plan.strategy == StrategyClamp) {
+      Value *first_valid_pointer;
+      Value *last_value_for_type;
+      validAddressBounds(limit, ptr->getType(), meminst, plan, location, first_valid_pointer, last_value_for_type);
+      profiler.countCheck(id, meminst);
+      Value *failed = createClampCheck(ptr, first_valid_pointer, last_value_for_type, meminst, postfix);
+      setCheckLocation(previous ? previous->getNextNode() : &BB->front(), meminst, location);
+      if (isa<LoadInst>(meminst)) {
+        meminst->getNextNode()->setDebugLoc(location);
+      }
+      if (profiler.enabled() || telemetry.enabled()) {
+        // counting and recording failures needs a block of its own,
+        // entered only on failure, so that passing checks pay for neither
+        Instruction *failedInst = cast<Instruction>(failed);
+        BasicBlock *head = failedInst->getParent();
+        BasicBlock *tail = head->splitBasicBlock(failedInst->getNextNode(), "boundary.check.done." + postfix);
+        BasicBlock *record = BasicBlock::Create(c, "boundary.check.record." + postfix, F, tail);
+        head->getTerminator()->eraseFromParent();
+        BranchInst *branch = BranchInst::Create(record, tail, failed, head);
+        profiler.addWeights(id, F, branch);
+        BranchInst::Create(tail, record);
+        profiler.countFailure(id, record);
+        telemetry.recordFailure(id, ptr, first_valid_pointer, last_value_for_type, record->getTerminator());
+        setCheckLocation(&record->front(), NULL, location);
+        head->getTerminator()->setDebugLoc(location);
+      }
+      DEBUG( dbgs() << "Created clamping check for: "; meminst->print(dbgs()); dbgs() << "\n"; );
+      return;
+    }
 
     // ------ this block is destination of all places where limit check fails, needs unconditional just branch to if.end block
     BasicBlock* boundary_fail_block = BasicBlock::Create( c, "boundary.check.failed." + postfix, F );
@@ -2801,7 +3616,7 @@ namespace WebCL {
     Value *last_value_for_type;
     // *   %2 = value to compare to get first valid address
     Value *first_valid_pointer;
-    limit->validAddressBoundsFor(ptr->getType(), meminst, first_valid_pointer, last_value_for_type);
+    validAddressBounds(limit, ptr->getType(), meminst, plan, location, first_valid_pointer, last_value_for_type);
 
     // ------ add max boundary check code
 
@@ -2811,7 +3626,9 @@ namespace WebCL {
     // *   %3 = icmp ugt i32* %0, %1
     ICmpInst* cmp = new ICmpInst( meminst, CmpInst::ICMP_UGT, ptr, last_value_for_type, "" );
     // *   br i1 %3, label %boundary.check.failed, label %check.first.limit
-    BranchInst::Create( boundary_fail_block, check_first_block, cmp, meminst );
+    BranchInst* branch = BranchInst::Create( boundary_fail_block, check_first_block, cmp, meminst );
+    profiler.countCheck(id, cmp);
+    profiler.addWeights(id, F, branch);
 
     // ------ break current BB to 3 parts, start, boundary_check_ok and if_end (meminst is left in ok block)
 
@@ -2829,6 +3646,8 @@ namespace WebCL {
 
     // and add unconditional branch from boundary_fail_block to if.end 
     BranchInst::Create( end_block, boundary_fail_block );
+    profiler.countFailure(id, boundary_fail_block);
+    telemetry.recordFailure(id, ptr, first_valid_pointer, last_value_for_type, boundary_fail_block->getTerminator());
 
     // ------ add min boundary check code
     // * check.first.limit:
@@ -2837,7 +3656,8 @@ namespace WebCL {
     ICmpInst* cmp2 = new ICmpInst( *check_first_block, CmpInst::ICMP_ULT, ptr, first_valid_pointer, "" );
 
     // *   br i1 %4, label %boundary.check.failed, label %if.end
-    BranchInst::Create( boundary_fail_block, boundary_ok_block, cmp2, check_first_block );
+    BranchInst* branch2 = BranchInst::Create( boundary_fail_block, boundary_ok_block, cmp2, check_first_block );
+    profiler.addWeights(id, F, branch2);
 
     // if meminst == load, create phi node to start of if.end block and replace all uses of meminst with this phi
     if ( dyn_cast<LoadInst>(meminst) ) {
@@ -2847,6 +3667,14 @@ namespace WebCL {
       newPhi->addIncoming(Constant::getNullValue(meminst->getType()), boundary_fail_block);
     }
 
+    setCheckLocation(previous ? previous->getNextNode() : &BB->front(), NULL, location);
+    setCheckLocation(&check_first_block->front(), NULL, location);
+    setCheckLocation(&boundary_fail_block->front(), NULL, location);
+    boundary_ok_block->getTerminator()->setDebugLoc(location);
+    if (isa<LoadInst>(meminst)) {
+      end_block->front().setDebugLoc(location);
+    }
+
     // organize blocks to order shown in comment
     check_first_block->moveAfter(BB);
     boundary_ok_block->moveAfter(check_first_block);
@@ -3321,6 +4149,15 @@ namespace WebCL {
       dbgs() << "Analysis usage was actually called.\n";
     }
 #endif
+
+    // analyses for [CheckPlanner](#CheckPlanner), required only for -clamp-pointers-strategy=auto
+    // and -clamp-pointers-check-report so that other builds don't pay for them
+    virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+      if (CheckPlanner::estimates()) {
+        AU.addRequired<CheckEstimates>();
+        AU.addRequired<AliasAnalysis>();
+      }
+    }
       
     // ## <a id="runOnModule"></a> Run On Module
     //
@@ -3503,19 +4340,62 @@ namespace WebCL {
       // [addBoundaryChecks( ... )](#addBoundaryChecks)
       DEBUG( dbgs() << "\n --------------- ADDING BOUNDARY CHECKS --------------\n" );
       // TODO: wrap to addBoundaryChecks function....
-      for (InstrSet::iterator inst = dependenceAnalyser.needCheck().begin(); inst != dependenceAnalyser.needCheck().end(); inst++) {
+      // Checks are numbered in module order, which keeps their ids the same from build to build.
+      std::vector<Instruction*> checkedInstructions;
+      for (Module::iterator F = M.begin(); F != M.end(); ++F) {
+        for (Function::iterator BB = F->begin(); BB != F->end(); ++BB) {
+          for (BasicBlock::iterator I = BB->begin(); I != BB->end(); ++I) {
+            if (dependenceAnalyser.needCheck().count(I)) {
+              checkedInstructions.push_back(I);
+            }
+          }
+        }
+      }
+      fast_assert(checkedInstructions.size() == dependenceAnalyser.needCheck().size(),
+                  "Found an instruction to check outside of the module.");
+
+      CheckProfiler profiler(M, checkedInstructions.size());
+      CheckTelemetry telemetry(M);
+      CheckPlanner planner(*this, profiler);
+      if (planner.estimates()) {
+        // every function is planned before checks change any of them
+        unsigned firstId = 0;
+        for (Module::iterator F = M.begin(); F != M.end(); ++F) {
+          Function *function = F;
+          std::vector<Instruction*> checks;
+          while (firstId + checks.size() < checkedInstructions.size() &&
+                 checkedInstructions[firstId + checks.size()]->getParent()->getParent() == function) {
+            checks.push_back(checkedInstructions[firstId + checks.size()]);
+          }
+          if (!function->isDeclaration()) {
+            planner.plan(*function, checks, firstId);
+          }
+          firstId += checks.size();
+        }
+        if (CheckReport) {
+          planner.report(M, errs());
+        }
+      }
+
+      CheckLocator locator(M);
+      for (unsigned id = 0; id < checkedInstructions.size(); id++) {
+        Instruction *inst = checkedInstructions[id];
         Value *ptrOperand = NULL;
-        if (LoadInst *load = dyn_cast<LoadInst>(*inst)) {
+        if (LoadInst *load = dyn_cast<LoadInst>(inst)) {
           ptrOperand = load->getPointerOperand();
-        } else if (StoreInst *store = dyn_cast<StoreInst>(*inst)) {
+        } else if (StoreInst *store = dyn_cast<StoreInst>(inst)) {
           ptrOperand = store->getPointerOperand();
         } else {
           fast_assert(false, "Can add check only for load or store");
         }
         
-        DEBUG( dbgs() << "Adding limit checks for:"; (*inst)->print(dbgs()); dbgs() << " op: "; ptrOperand->print(dbgs()); dbgs() << "\n" );
-        createLimitCheck(ptrOperand, areaLimitManager.getAreaLimits(*inst, ptrOperand), *inst);
+        DEBUG( dbgs() << "Adding limit checks for:"; inst->print(dbgs()); dbgs() << " op: "; ptrOperand->print(dbgs()); dbgs() << "\n" );
+        profiler.describeCheck(id, inst);
+        const CheckPlan &plan = planner.planFor(id);
+        createLimitCheck(ptrOperand, areaLimitManager.getAreaLimits(inst, ptrOperand), inst, id, profiler, telemetry, plan,
+                         locator.locate(id, inst, plan.strategy));
       }
+      profiler.finish();
 
       // Goes through all builtin WebCL calls and if they are unsafe (has pointer arguments), converts instruction to call safe
       // version of it instead. Value limits are required to be able to resolve which limit to pass to safe builtin call.
@@ -3530,6 +4410,7 @@ namespace WebCL {
         delete *it;
       }
       
+      locator.finish();
       DEBUG( dbgs() << "------------- FINISHED TRANSFORMATION -----------\n"; );
 
       // Helps to print out resulted LLVM IR code if pass fails before writing results
@@ -3695,3 +4576,135 @@ static RegisterPass<WebCL::ClampPointers>
 X("clamp-pointers", "Adds dynamic checks to prevent accessing memory outside of allocated area.", 
   false, false);
 
+char WebCL::CheckEstimates::ID = 0;
+static RegisterPass<WebCL::CheckEstimates>
+E("clamp-pointers-check-estimates", "Function analyses for choosing how boundary checks are lowered.",
+  true, true);
+
+
+namespace WebCL {
+  // ## FakeCL entry thunks
+  //
+  // Gives each kernel listed in opencl.kernels an entry point
+  // `void __fakecl_entry_<kernel>(i8* block)` taking all of the kernel's
+  // parameters packed into one block, so that FakeCL can call kernels of
+  // any arity without going through varargs, and exports the number of
+  // parameters as `i32 __fakecl_params_<kernel>` for FakeCL to check calls
+  // against. `[n x i8] __fakecl_pointers_<kernel>` is 1 for each parameter
+  // that is a pointer, which the host sets with a buffer, and 0 for one
+  // passed by value. `i32 __fakecl_barriers_<kernel>` is 0 when no barrier() is
+  // reachable from the kernel, letting FakeCL run its work-groups as plain
+  // loops without detecting barriers. Run this after clamp-pointers to get
+  // entries of the WebCL kernels.
+  //
+  // Each parameter is at the next offset aligned to the smallest power of
+  // two not less than its allocation size, at most 16. This must match the
+  // layout clSetKernelArg in tests/FakeCL.cpp builds. A byval parameter
+  // takes the bytes of the value it points to, as the host sets them, and
+  // the kernel is passed their address in the block.
+  struct FakeClEntryThunks :
+    public ModulePass {
+    static char ID;
+
+    FakeClEntryThunks() :
+      ModulePass( ID ) {
+    }
+
+    // Whether F may call barrier(), directly or through any function it
+    // calls. Calls through pointers are assumed to.
+    bool mayReachBarrier( Function *F, FunctionSet &visited ) {
+      if (!visited.insert(F).second) {
+        return false;
+      }
+      for ( Function::iterator bb = F->begin(); bb != F->end(); bb++ ) {
+        for ( BasicBlock::iterator i = bb->begin(); i != bb->end(); i++ ) {
+          CallInst *call = dyn_cast<CallInst>(i);
+          if (call == NULL || isa<InlineAsm>(call->getCalledValue())) {
+            continue;
+          }
+          Function *callee = call->getCalledFunction();
+          if (callee == NULL || callee->getName() == "barrier") {
+            return true;
+          }
+          if (!callee->isDeclaration() && mayReachBarrier(callee, visited)) {
+            return true;
+          }
+        }
+      }
+      return false;
+    }
+
+    virtual bool runOnModule( Module &M ) {
+      NamedMDNode* oclKernels = M.getNamedMetadata("opencl.kernels");
+      if (oclKernels == NULL) {
+        return false;
+      }
+
+      LLVMContext& c = M.getContext();
+      DataLayout dataLayout(&M);
+      FunctionType* thunkType = FunctionType::get(Type::getVoidTy(c), Type::getInt8PtrTy(c), false);
+
+      for (unsigned int op = 0; op < oclKernels->getNumOperands(); op++) {
+        Function* kernel = dyn_cast<Function>(oclKernels->getOperand(op)->getOperand(0));
+        fast_assert(kernel, "Kernel metadata does not refer to a function.");
+
+        Function* thunk = Function::Create(thunkType, GlobalValue::ExternalLinkage,
+                                           "__fakecl_entry_" + kernel->getName(), &M);
+        Value* block = thunk->arg_begin();
+        block->setName("block");
+        IRBuilder<> builder(BasicBlock::Create(c, "entry", thunk));
+
+        std::vector<Value*> args;
+        std::vector<uint8_t> pointers;
+        uint64_t offset = 0;
+        for( Function::arg_iterator a = kernel->arg_begin(); a != kernel->arg_end(); ++a ) {
+          Type* t = a->getType();
+          bool byVal = a->hasByValAttr();
+          pointers.push_back(t->isPointerTy() && !byVal);
+          uint64_t size = dataLayout.getTypeAllocSize(byVal ? t->getPointerElementType() : t);
+          unsigned alignment = 1;
+          while (alignment < size && alignment < 16) {
+            alignment *= 2;
+          }
+          offset = (offset + alignment - 1) / alignment * alignment;
+
+          Value* slot = builder.CreateConstGEP1_64(block, offset);
+          if (byVal) {
+            // the kernel gets the address of the bytes in the block
+            args.push_back(builder.CreateBitCast(slot, t, a->getName()));
+          } else {
+            LoadInst* value = builder.CreateLoad(builder.CreateBitCast(slot, t->getPointerTo()), a->getName());
+            // the block is 64-byte aligned, so the slot is as aligned as its offset
+            value->setAlignment(alignment);
+            args.push_back(value);
+          }
+          offset += size;
+        }
+
+        CallInst* call = builder.CreateCall(kernel, args);
+        call->setCallingConv(kernel->getCallingConv());
+        // including byval, with which the call passes a copy of those bytes
+        call->setAttributes(kernel->getAttributes());
+        builder.CreateRetVoid();
+
+        new GlobalVariable(M, Type::getInt32Ty(c), true, GlobalValue::ExternalLinkage,
+                           ConstantInt::get(Type::getInt32Ty(c), args.size()),
+                           "__fakecl_params_" + kernel->getName());
+        Constant* pointerFlags = ConstantDataArray::get(c, pointers);
+        new GlobalVariable(M, pointerFlags->getType(), true, GlobalValue::ExternalLinkage,
+                           pointerFlags, "__fakecl_pointers_" + kernel->getName());
+        FunctionSet visited;
+        new GlobalVariable(M, Type::getInt32Ty(c), true, GlobalValue::ExternalLinkage,
+                           ConstantInt::get(Type::getInt32Ty(c), mayReachBarrier(kernel, visited)),
+                           "__fakecl_barriers_" + kernel->getName());
+        DEBUG( dbgs() << "Created entry thunk: "; thunk->print(dbgs()); dbgs() << "\n" );
+      }
+      return true;
+    }
+  };
+}
+
+char WebCL::FakeClEntryThunks::ID = 0;
+static RegisterPass<WebCL::FakeClEntryThunks>
+Y("fakecl-entry-thunks", "Adds FakeCL entry points taking kernel arguments packed into one block.",
+  false, false);
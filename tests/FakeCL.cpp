@@ -12,9 +12,27 @@
 #include <cassert>
 #include <pthread.h>
 #include <cstdio>
+#include <cstdlib>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
+#include <algorithm>
+#include <deque>
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -22,37 +40,1088 @@
 #define R(type, value) if (param_value_size_ret) *param_value_size_ret = sizeof(type); if (sizeof(type) <= param_value_size) * (type*) param_value = value; return 0;
 #define RS(str) if (param_value_size_ret) *param_value_size_ret = sizeof(str); if (sizeof(str) <= param_value_size) std::memcpy(param_value, str, sizeof(str)); return 0;
 
-const int work_group_size = 64;
-
 namespace {
+  // stack of a single work-item fiber, not counting its guard page
+  const size_t fiber_stack_size = 128 * 1024;
+
+  // work-items of a group when the local size isn't given, so that even
+  // small ranges split into groups for every worker
+  const size_t default_work_group_size = 64;
+
   std::map<std::string, fakecl_kernel_fn> fakecl_kernel_funcs;
-}
+  std::map<std::string, fakecl_kernel_entry> fakecl_kernel_entries;
 
-pthread_mutex_t barrier_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t barrier_cond = PTHREAD_COND_INITIALIZER;
-int barrier_max = work_group_size;
-int barrier_enter = 0;          // number of threads waiting in barrier, in range 0..barrier_max
-int barrier_completed_seq = 0;
+  // argument blocks are allocated at least this aligned
+  const size_t arg_block_alignment = 64;
+
+  // alignment of an argument in the block, see FakeCL.h
+  size_t argAlignment(size_t size)
+  {
+    size_t alignment = 1;
+    while (alignment < size && alignment < 16) {
+      alignment *= 2;
+    }
+    return alignment;
+  }
+}
 
-typedef struct {
+struct cl_mem_struct {
   void* ptr;
   size_t size;
-  bool do_delete;
-} cl_mem_info;
+  size_t capacity;              // size of the allocation ptr came from
+  bool do_delete;               // ptr came from the buffer pool
+  int node;                     // of the pool the memory came from
+};
 
+// where an argument lives in the kernel's argument block
 struct cl_arg {
   bool is_local;
-  std::vector<char> data;
+  size_t local_size;            // bytes to allocate for a __local argument
+  size_t size;                  // bytes of the argument's slot in the block
+  size_t offset;                // of the slot in the block
 };
 
+namespace {
+  // The buffer a program built with -clamp-pointers-telemetry records
+  // failed boundary checks in, head NULL for other programs
+  struct ClampTelemetry {
+    uint64_t* head;             // failures so far, also those not recorded
+    const fakecl_clamp_violation* records;
+    int capacity;
+  };
+}
+
+// Arguments are stored as set, buffers resolved to their data pointer,
+// in one packed block laid out as described in FakeCL.h.
 struct cl_kernel_struct {
-  fakecl_kernel_fn fn;
-  int arg_count;
-  cl_arg args[FAKECL_MAX_ARGS];
+  fakecl_kernel_entry entry;    // takes the block, if the kernel has one
+  fakecl_kernel_fn fn;          // otherwise called with varargs
+  int param_count;              // the kernel's, or -1 if not known
+  const char* pointers;         // 1 for each pointer parameter, or NULL if not known
+  int barriers;                 // 1 if it may call barrier(), 0 if not, -1 if not known yet
+  bool profiled;                // its program counts boundary checks
+  ClampTelemetry telemetry;
+  std::vector<cl_arg> args;
+  std::vector<char> block;
+};
+
+namespace {
+  // An entry of the plugin's __clamp_profile_checks table
+  struct ClampCheck {
+    const char* function;
+    const char* file;
+    int line;
+    int column;
+    int is_store;
+  };
+
+  // The check profile of a program built with -clamp-pointers-profile:
+  // executions and failures of each check, and the table describing them
+  struct ClampProfile {
+    const uint64_t (*counters)[2];
+    const ClampCheck* checks;
+    int check_count;
+  };
+
+  // profiles of the programs kernels have been created from
+  std::vector<ClampProfile> clamp_profiles;
+  pthread_mutex_t clamp_profiles_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+  // registers the check profile of a program once, returns whether it
+  // has one
+  bool registerClampProfile(void* library)
+  {
+    ClampProfile profile;
+    profile.counters = (const uint64_t (*)[2]) dlsym(library, "__clamp_profile_counters");
+    profile.checks = (const ClampCheck*) dlsym(library, "__clamp_profile_checks");
+    const int* check_count = (const int*) dlsym(library, "__clamp_profile_check_count");
+    if (!profile.counters || !profile.checks || !check_count) {
+      return false;
+    }
+    profile.check_count = *check_count;
+    pthread_mutex_lock(&clamp_profiles_mutex);
+    bool known = false;
+    for (size_t i = 0; i < clamp_profiles.size(); ++i) {
+      known = known || clamp_profiles[i].counters == profile.counters;
+    }
+    if (!known) {
+      clamp_profiles.push_back(profile);
+    }
+    pthread_mutex_unlock(&clamp_profiles_mutex);
+    return true;
+  }
+
+  fakecl_violation_handler violation_handler = NULL;
+  void* violation_handler_data = NULL;
+  // serializes emptying the buffers
+  pthread_mutex_t telemetry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+  ClampTelemetry findClampTelemetry(void* library)
+  {
+    ClampTelemetry telemetry;
+    telemetry.head = (uint64_t*) dlsym(library, "__clamp_telemetry_head");
+    telemetry.records = (const fakecl_clamp_violation*) dlsym(library, "__clamp_telemetry_records");
+    const int* capacity = (const int*) dlsym(library, "__clamp_telemetry_capacity");
+    telemetry.capacity = capacity ? *capacity : 0;
+    if (!telemetry.records || !capacity) {
+      telemetry.head = NULL;
+    }
+    return telemetry;
+  }
+
+  // passes the failures recorded during a launch to the handler and
+  // empties the buffer. Launches of the same program running at the same
+  // time on different queues share the buffer.
+  void reportClampViolations(const ClampTelemetry& telemetry)
+  {
+    if (!telemetry.head) {
+      return;
+    }
+    pthread_mutex_lock(&telemetry_mutex);
+    uint64_t failures = __sync_lock_test_and_set(telemetry.head, 0);
+    size_t count = std::min(failures, (uint64_t) telemetry.capacity);
+    unsigned long long dropped = failures - count;
+    if (failures == 0) {
+      // nothing to report
+    } else if (violation_handler) {
+      violation_handler(telemetry.records, count, dropped, violation_handler_data);
+    } else {
+      for (size_t i = 0; i < count; ++i) {
+        const fakecl_clamp_violation& v = telemetry.records[i];
+        fprintf(stderr, "fakecl: boundary check %d failed for work-item (%llu,%llu,%llu): "
+                "address 0x%llx, valid 0x%llx-0x%llx\n", v.check,
+                v.work_item[0], v.work_item[1], v.work_item[2], v.address, v.first, v.last);
+      }
+      if (dropped) {
+        fprintf(stderr, "fakecl: %llu more boundary check failures were not recorded\n", dropped);
+      }
+    }
+    pthread_mutex_unlock(&telemetry_mutex);
+  }
+}
+
+namespace {
+  // buffer handles that have been created and not released yet
+  std::set<cl_mem> live_buffers;
+  pthread_mutex_t live_buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+  // Recycles buffer memory between clReleaseMemObject and
+  // clCreateBuffer. Small buffers come in power-of-two size classes and
+  // are aligned to a cache line. Large ones are rounded up to whole huge
+  // pages and advised to use transparent huge pages; they are reused
+  // only for the same rounded size. Released memory is kept up to
+  // max_cached bytes, beyond that it is returned at once.
+  // Blocks of a page or more are mapped directly, so their pages are
+  // placed on the NUMA node that first touches them, and are reused only
+  // on that node, node -1 standing for any. Smaller blocks come from
+  // malloc and share pages with other memory, so they are on whichever
+  // node those pages are.
+  class BufferPool {
+  public:
+    static const size_t alignment = 64;
+    static const size_t huge_page_size = 2 << 20;
+    static const size_t max_cached = 256 << 20;
+
+    BufferPool() :
+      page_size(sysconf(_SC_PAGESIZE)),
+      cached(0) {
+      pthread_mutex_init(&mutex, NULL);
+    }
+
+    // returns at least size bytes and sets capacity to their real size;
+    // fresh tells whether they are new memory, not touched yet
+    void* allocate(size_t size, int node, size_t& capacity, bool& fresh) {
+      capacity = roundUp(size);
+      pthread_mutex_lock(&mutex);
+      void* ptr = NULL;
+      BlockMap::iterator it = free_blocks.find(std::make_pair(node, capacity));
+      if (it != free_blocks.end()) {
+        ptr = it->second;
+        free_blocks.erase(it);
+        cached -= capacity;
+      }
+      pthread_mutex_unlock(&mutex);
+      fresh = !ptr;
+      if (ptr) {
+        return ptr;
+      }
+
+      if (capacity >= page_size) {
+        ptr = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) {
+          return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        if (capacity >= huge_page_size) {
+          madvise(ptr, capacity, MADV_HUGEPAGE);
+        }
+#endif
+      } else if (posix_memalign(&ptr, alignment, capacity) != 0) {
+        return NULL;
+      }
+      return ptr;
+    }
+
+    void release(void* ptr, int node, size_t capacity) {
+      pthread_mutex_lock(&mutex);
+      bool keep = cached + capacity <= max_cached;
+      if (keep) {
+        free_blocks.insert(std::make_pair(std::make_pair(node, capacity), ptr));
+        cached += capacity;
+      }
+      pthread_mutex_unlock(&mutex);
+      if (!keep) {
+        if (capacity >= page_size) {
+          munmap(ptr, capacity);
+        } else {
+          free(ptr);
+        }
+      }
+    }
+
+  private:
+    static size_t roundUp(size_t size) {
+      if (size >= huge_page_size) {
+        return (size + huge_page_size - 1) / huge_page_size * huge_page_size;
+      }
+      size_t capacity = alignment;
+      while (capacity < size) {
+        capacity *= 2;
+      }
+      return capacity;
+    }
+
+    typedef std::multimap<std::pair<int, size_t>, void*> BlockMap;
+
+    size_t page_size;
+    pthread_mutex_t mutex;
+    BlockMap free_blocks;       // by node and capacity
+    size_t cached;              // bytes in free_blocks
+  };
+
+  BufferPool buffer_pool;
+
+  // pins the calling thread to the CPUs
+  void pinThread(const std::vector<int>& cpus)
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cpus.size(); ++i) {
+      CPU_SET(cpus[i], &set);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+
+  // A fixed set of worker threads, created once per context and reused
+  // for every launch. run() executes fn(ctx, idx) for idx in
+  // 0..count-1, each index on a worker of its own. With pin, worker i
+  // runs only on cpus[i].
+  class WorkerPool {
+  public:
+    typedef void (*JobFn)(void* ctx, int idx);
+
+    WorkerPool(const std::vector<int>& cpus, bool pin) :
+      workers(cpus.size()),
+      generation(0),
+      job_fn(NULL),
+      job_ctx(NULL),
+      job_count(0),
+      pending(0),
+      quit(false) {
+      pthread_mutex_init(&run_mutex, NULL);
+      pthread_mutex_init(&mutex, NULL);
+      pthread_cond_init(&start_cond, NULL);
+      pthread_cond_init(&done_cond, NULL);
+      for (size_t i = 0; i < cpus.size(); ++i) {
+        workers[i].pool = this;
+        workers[i].index = i;
+        workers[i].cpu = pin ? cpus[i] : -1;
+        pthread_create(&workers[i].thread, NULL, workerMain, &workers[i]);
+      }
+    }
+
+    ~WorkerPool() {
+      pthread_mutex_lock(&mutex);
+      quit = true;
+      pthread_cond_broadcast(&start_cond);
+      pthread_mutex_unlock(&mutex);
+      for (size_t i = 0; i < workers.size(); ++i) {
+        pthread_join(workers[i].thread, NULL);
+      }
+      pthread_cond_destroy(&done_cond);
+      pthread_cond_destroy(&start_cond);
+      pthread_mutex_destroy(&mutex);
+      pthread_mutex_destroy(&run_mutex);
+    }
+
+    int size() const {
+      return workers.size();
+    }
+
+    // returns when every index of the job has finished. Jobs posted by
+    // different threads run one after another.
+    void run(JobFn fn, void* ctx, int count) {
+      assert(count <= size());
+      if (count == 0) {
+        return;
+      }
+      pthread_mutex_lock(&run_mutex);
+      pthread_mutex_lock(&mutex);
+      job_fn = fn;
+      job_ctx = ctx;
+      job_count = count;
+      pending = count;
+      ++generation;
+      pthread_cond_broadcast(&start_cond);
+      while (pending > 0) {
+        pthread_cond_wait(&done_cond, &mutex);
+      }
+      pthread_mutex_unlock(&mutex);
+      pthread_mutex_unlock(&run_mutex);
+    }
+
+  private:
+    struct Worker {
+      WorkerPool* pool;
+      int index;
+      int cpu;                  // the worker is pinned to, or -1
+      pthread_t thread;
+    };
+
+    static void* workerMain(void* opaque) {
+      Worker* worker = static_cast<Worker*>(opaque);
+      WorkerPool* pool = worker->pool;
+      if (worker->cpu >= 0) {
+        pinThread(std::vector<int>(1, worker->cpu));
+      }
+      int seen = 0;
+      pthread_mutex_lock(&pool->mutex);
+      while (true) {
+        while (!pool->quit && pool->generation == seen) {
+          pthread_cond_wait(&pool->start_cond, &pool->mutex);
+        }
+        if (pool->quit) {
+          break;
+        }
+        seen = pool->generation;
+        if (worker->index < pool->job_count) {
+          JobFn fn = pool->job_fn;
+          void* ctx = pool->job_ctx;
+          pthread_mutex_unlock(&pool->mutex);
+          fn(ctx, worker->index);
+          pthread_mutex_lock(&pool->mutex);
+          if (--pool->pending == 0) {
+            pthread_cond_signal(&pool->done_cond);
+          }
+        }
+      }
+      pthread_mutex_unlock(&pool->mutex);
+      return NULL;
+    }
+
+    // doesn't exist: the pool is not copyable
+    WorkerPool(const WorkerPool&);
+    void operator=(const WorkerPool&);
+
+    std::vector<Worker> workers;
+    pthread_mutex_t run_mutex;  // held for the whole of run()
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond;  // signaled when a new job is posted or on quit
+    pthread_cond_t done_cond;   // signaled when the last index of a job finishes
+    int generation;             // incremented for each job
+    JobFn job_fn;
+    void* job_ctx;
+    int job_count;
+    int pending;                // indices of the current job still running
+    bool quit;
+  };
+}
+
+namespace {
+  struct GroupRunner;
+
+  int cpuCount()
+  {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+  }
+}
+
+namespace {
+  bool readFile(const std::string& path, std::string& contents)
+  {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+      return false;
+    }
+    contents.clear();
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+      contents.append(chunk, n);
+    }
+    fclose(file);
+    return true;
+  }
+
+  // what clGetDeviceInfo reports about the host, probed once
+  struct HostInfo {
+    cl_uint compute_units;
+    cl_uint clock_mhz;
+    cl_ulong memory_size;
+    cl_ulong cache_size;          // of the last level cache
+    cl_uint cacheline_size;
+    cl_ulong l2_cache_size;       // a core's, which the local arena fits in
+    cl_uint vector_bytes;         // of the widest SIMD registers
+    size_t max_work_group_size;   // work-items a worker has fiber stacks for
+  };
+
+  HostInfo host_info;
+  pthread_once_t host_info_once = PTHREAD_ONCE_INIT;
+
+  long readSysfsLong(const std::string& path)
+  {
+    std::string contents;
+    if (!readFile(path, contents)) {
+      return 0;
+    }
+    // sizes are like "32K"
+    char* end;
+    long value = strtol(contents.c_str(), &end, 10);
+    if (*end == 'K') {
+      value *= 1024;
+    } else if (*end == 'M') {
+      value *= 1024 * 1024;
+    }
+    return value;
+  }
+
+  void host_info_init()
+  {
+    host_info.compute_units = cpuCount();
+    host_info.memory_size = (cl_ulong) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+
+    host_info.clock_mhz = readSysfsLong("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq") / 1000;
+    if (!host_info.clock_mhz) {
+      std::string cpuinfo;
+      size_t at = readFile("/proc/cpuinfo", cpuinfo) ? cpuinfo.find("cpu MHz") : std::string::npos;
+      if (at != std::string::npos) {
+        at = cpuinfo.find(':', at);
+        host_info.clock_mhz = at != std::string::npos ? atoi(cpuinfo.c_str() + at + 1) : 0;
+      }
+    }
+
+    // cpu0's data and unified caches
+    host_info.cache_size = 0;
+    host_info.cacheline_size = 0;
+    host_info.l2_cache_size = 0;
+    int cache_level = 0;
+    for (int index = 0; ; ++index) {
+      char dir[64];
+      snprintf(dir, sizeof(dir), "/sys/devices/system/cpu/cpu0/cache/index%d/", index);
+      std::string type;
+      if (!readFile(std::string(dir) + "type", type)) {
+        break;
+      }
+      if (type.compare(0, 4, "Data") != 0 && type.compare(0, 7, "Unified") != 0) {
+        continue;
+      }
+      int level = readSysfsLong(std::string(dir) + "level");
+      long size = readSysfsLong(std::string(dir) + "size");
+      if (level == 1) {
+        host_info.cacheline_size = readSysfsLong(std::string(dir) + "coherency_line_size");
+      } else if (level == 2) {
+        host_info.l2_cache_size = size;
+      }
+      if (level > cache_level) {
+        cache_level = level;
+        host_info.cache_size = size;
+      }
+    }
+#ifdef _SC_LEVEL1_DCACHE_LINESIZE
+    // no sysfs, as in some containers
+    if (!host_info.cacheline_size) {
+      host_info.cacheline_size = std::max(0L, sysconf(_SC_LEVEL1_DCACHE_LINESIZE));
+    }
+    if (!host_info.l2_cache_size) {
+      host_info.l2_cache_size = std::max(0L, sysconf(_SC_LEVEL2_CACHE_SIZE));
+    }
+    if (!host_info.cache_size) {
+      host_info.cache_size = std::max(std::max(0L, sysconf(_SC_LEVEL3_CACHE_SIZE)),
+                                      (long) host_info.l2_cache_size);
+    }
+#endif
+    if (!host_info.cacheline_size) {
+      host_info.cacheline_size = 64;
+    }
+    if (!host_info.l2_cache_size) {
+      host_info.l2_cache_size = 32 * 1024;
+    }
+
+    // cpuid, through the compiler, including whether the OS saves the
+    // wider registers
+    host_info.vector_bytes = 16;
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+      host_info.vector_bytes = 64;
+    } else if (__builtin_cpu_supports("avx")) {
+      host_info.vector_bytes = 32;
+    }
+#endif
+
+    // Each worker reserves a fiber stack for every work-item of a group.
+    // Stacks take memory only as they are used, but all workers' stacks
+    // together are kept within a sixteenth of memory. The size is a power
+    // of two from 64 up to 4096, the most CPU implementations allow.
+    size_t slot_size = fiber_stack_size + sysconf(_SC_PAGESIZE);
+    size_t fitting = host_info.memory_size / 16 / std::max<cl_uint>(1, host_info.compute_units) / slot_size;
+    host_info.max_work_group_size = 64;
+    while (host_info.max_work_group_size < 4096 && host_info.max_work_group_size * 2 <= fitting) {
+      host_info.max_work_group_size *= 2;
+    }
+  }
+
+  const HostInfo& hostInfo()
+  {
+    pthread_once(&host_info_once, host_info_init);
+    return host_info;
+  }
+
+  // Each __local argument starts on a cache line of its own, so that
+  // neither false sharing nor the layout of the previous argument
+  // changes its performance.
+  size_t localLineSize()
+  {
+    return std::max<size_t>(64, hostInfo().cacheline_size);
+  }
+
+  // of the arguments' slots in the local arena
+  size_t localArgsSize(const std::vector<cl_arg>& args)
+  {
+    size_t line = localLineSize();
+    size_t size = 0;
+    for (size_t i = 0; i < args.size(); ++i) {
+      if (args[i].is_local) {
+        size += (args[i].local_size + line - 1) / line * line;
+      }
+    }
+    return size;
+  }
+
+  // Each worker has a local arena of this size for the __local arguments
+  // of the group it runs, a core's L2 so that they stay in cache. This is
+  // the device's CL_DEVICE_LOCAL_MEM_SIZE.
+  size_t localArenaSize()
+  {
+    return hostInfo().l2_cache_size / localLineSize() * localLineSize();
+  }
+}
+
+namespace {
+  // The CPUs of each device, ordered by NUMA node. Device 0 is the
+  // whole host, the others are sub-devices made by clCreateSubDevices;
+  // they are never destroyed.
+  struct Device {
+    std::vector<int> cpus;
+    int node;                   // every CPU is on, or -1
+    cl_device_id parent;        // or -1 for the host
+  };
+
+  std::vector<Device> devices;
+  std::map<int, int> cpu_nodes; // from sysfs, empty if not NUMA
+  pthread_mutex_t devices_mutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_once_t devices_once = PTHREAD_ONCE_INIT;
+
+  // parses a sysfs CPU list like "0-3,8"
+  std::vector<int> parseCpuList(const std::string& list)
+  {
+    std::vector<int> cpus;
+    const char* p = list.c_str();
+    while (*p >= '0' && *p <= '9') {
+      char* end;
+      int first = strtol(p, &end, 10);
+      int last = *end == '-' ? strtol(end + 1, &end, 10) : first;
+      for (int cpu = first; cpu <= last; ++cpu) {
+        cpus.push_back(cpu);
+      }
+      p = *end == ',' ? end + 1 : end;
+    }
+    return cpus;
+  }
+
+  int nodeOf(int cpu)
+  {
+    std::map<int, int>::const_iterator it = cpu_nodes.find(cpu);
+    return it == cpu_nodes.end() ? -1 : it->second;
+  }
+
+  bool byNode(int a, int b)
+  {
+    return std::make_pair(nodeOf(a), a) < std::make_pair(nodeOf(b), b);
+  }
+
+  Device makeDevice(std::vector<int> cpus, cl_device_id parent)
+  {
+    std::sort(cpus.begin(), cpus.end(), byNode);
+    Device device;
+    device.cpus = cpus;
+    device.node = cpus.empty() ? -1 : nodeOf(cpus[0]);
+    for (size_t i = 0; i < cpus.size(); ++i) {
+      if (nodeOf(cpus[i]) != device.node) {
+        device.node = -1;
+      }
+    }
+    device.parent = parent;
+    return device;
+  }
+
+  void devices_init()
+  {
+    for (int node = 0; ; ++node) {
+      char path[64];
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+      std::string list;
+      if (!readFile(path, list)) {
+        // nodes may be numbered sparsely after hot-unplug, but rarely
+        if (node > 64) {
+          break;
+        }
+        continue;
+      }
+      std::vector<int> cpus = parseCpuList(list);
+      for (size_t i = 0; i < cpus.size(); ++i) {
+        cpu_nodes[cpus[i]] = node;
+      }
+    }
+
+    // the CPUs this process may run on
+    std::vector<int> cpus;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+      for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) {
+          cpus.push_back(cpu);
+        }
+      }
+    }
+    if (cpus.empty()) {
+      for (int cpu = 0; cpu < cpuCount(); ++cpu) {
+        cpus.push_back(cpu);
+      }
+    }
+    devices.push_back(makeDevice(cpus, -1));
+  }
+
+  // copies device id into device, returning false if there is none such
+  bool getDevice(cl_device_id id, Device& device)
+  {
+    pthread_once(&devices_once, devices_init);
+    pthread_mutex_lock(&devices_mutex);
+    bool found = id >= 0 && (size_t) id < devices.size();
+    if (found) {
+      device = devices[id];
+    }
+    pthread_mutex_unlock(&devices_mutex);
+    return found;
+  }
+}
+
+struct cl_context_struct {
+  cl_device_id device;
+  std::vector<int> cpus;        // of the device
+  bool pinned;                  // the threads run only on cpus, for a sub-device
+  int node;                     // every CPU is on, or -1
+  WorkerPool workers;
+  std::vector<GroupRunner*> runners; // runners[i] is used only by worker i
+
+  cl_context_struct(const Device& device, cl_device_id id);
+  ~cl_context_struct();
+};
+
+struct cl_event_struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;          // signaled when status changes
+  cl_int status;                // CL_QUEUED .. CL_COMPLETE
+  int refcount;
+  bool profiling;               // the times below are recorded
+  cl_ulong times[4];            // indexed by CL_PROFILING_COMMAND_*, in ns
 };
 
 namespace {
-  std::map<cl_mem, cl_mem_info> cl_mem_data;
+  class Command;
+}
+
+// Commands run in order on a thread of the queue's own, so the host
+// thread only waits when it asks to.
+struct cl_command_queue_struct {
+  cl_context context;
+  bool profiling;               // CL_QUEUE_PROFILING_ENABLE was given
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;          // signaled when a command is added or finished, or on quit
+  std::deque<Command*> commands; // commands.front() is running or about to
+  bool quit;
+};
+
+namespace {
+  // used by queues that were created without a context
+  pthread_once_t default_context_once = PTHREAD_ONCE_INIT;
+  cl_context default_context;
+
+  void default_context_init()
+  {
+    Device device;
+    getDevice(0, device);
+    default_context = new cl_context_struct(device, 0);
+  }
+
+  cl_context defaultContext()
+  {
+    pthread_once(&default_context_once, default_context_init);
+    return default_context;
+  }
+
+  cl_ulong nanoTime()
+  {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (cl_ulong) now.tv_sec * 1000000000 + now.tv_nsec;
+  }
+
+  cl_event newEvent()
+  {
+    cl_event event = new cl_event_struct;
+    pthread_mutex_init(&event->mutex, NULL);
+    pthread_cond_init(&event->cond, NULL);
+    event->status = CL_QUEUED;
+    event->refcount = 1;
+    event->profiling = false;
+    return event;
+  }
+
+  void retainEvent(cl_event event)
+  {
+    pthread_mutex_lock(&event->mutex);
+    ++event->refcount;
+    pthread_mutex_unlock(&event->mutex);
+  }
+
+  void releaseEvent(cl_event event)
+  {
+    pthread_mutex_lock(&event->mutex);
+    bool last = --event->refcount == 0;
+    pthread_mutex_unlock(&event->mutex);
+    if (last) {
+      pthread_cond_destroy(&event->cond);
+      pthread_mutex_destroy(&event->mutex);
+      delete event;
+    }
+  }
+
+  // also records the time of the change if the event is profiled
+  void setEventStatus(cl_event event, cl_int status)
+  {
+    pthread_mutex_lock(&event->mutex);
+    if (event->profiling) {
+      event->times[CL_QUEUED - status] = nanoTime();
+    }
+    event->status = status;
+    pthread_cond_broadcast(&event->cond);
+    pthread_mutex_unlock(&event->mutex);
+  }
+
+  void waitEvent(cl_event event)
+  {
+    pthread_mutex_lock(&event->mutex);
+    while (event->status > CL_COMPLETE) {
+      pthread_cond_wait(&event->cond, &event->mutex);
+    }
+    pthread_mutex_unlock(&event->mutex);
+  }
+
+  // A command in a queue. It holds a reference to its own event and to
+  // every event it waits for.
+  class Command {
+  public:
+    Command() :
+      event(newEvent()) {
+    }
+
+    virtual ~Command() {
+      for (size_t i = 0; i < wait_list.size(); ++i) {
+        releaseEvent(wait_list[i]);
+      }
+      releaseEvent(event);
+    }
+
+    virtual void execute() = 0;
+
+    std::vector<cl_event> wait_list;
+    cl_event event;
+  };
+
+  // transfers at least this big are split over the context's workers
+  const size_t parallel_transfer_size = 1 << 20;
+  // and each worker gets at least this much of one
+  const size_t transfer_part_size = 256 * 1024;
+  // a fill's pattern is repeated to this length; a multiple of every
+  // pattern size and of 16, and long enough to read 16 bytes from any
+  // phase of it
+  const size_t fill_line_size = 256;
+
+  // Copies size bytes. With stream, stores bypass the cache, which is
+  // faster when the destination would not stay in it anyway.
+  void copyBytes(char* dst, const char* src, size_t size, bool stream)
+  {
+#ifdef __SSE2__
+    if (stream && size >= 64) {
+      size_t head = (16 - (uintptr_t) dst % 16) % 16;
+      std::memcpy(dst, src, head);
+      size_t i = head;
+      for (; i + 64 <= size; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*) (src + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (src + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*) (src + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*) (src + i + 48));
+        _mm_stream_si128((__m128i*) (dst + i), a);
+        _mm_stream_si128((__m128i*) (dst + i + 16), b);
+        _mm_stream_si128((__m128i*) (dst + i + 32), c);
+        _mm_stream_si128((__m128i*) (dst + i + 48), d);
+      }
+      std::memcpy(dst + i, src + i, size - i);
+      _mm_sfence();
+      return;
+    }
+#endif
+    std::memcpy(dst, src, size);
+  }
+
+  // Fills size bytes from line, which repeats the pattern starting at
+  // dst's phase 0, like copyBytes.
+  void fillBytes(char* dst, const char* line, size_t pattern_size, size_t size, bool stream)
+  {
+#ifdef __SSE2__
+    if (stream && size >= 64) {
+      size_t head = std::min(size, (16 - (uintptr_t) dst % 16) % 16);
+      std::memcpy(dst, line, head);
+      size_t i = head;
+      for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (line + i % (fill_line_size / 2)));
+        _mm_stream_si128((__m128i*) (dst + i), v);
+      }
+      std::memcpy(dst + i, line + i % (fill_line_size / 2), size - i);
+      _mm_sfence();
+      return;
+    }
+#endif
+    if (pattern_size == 1) {
+      std::memset(dst, line[0], size);
+      return;
+    }
+    // doubles the filled prefix until it covers size
+    size_t filled = std::min(size, fill_line_size / 2);
+    std::memcpy(dst, line, filled);
+    while (filled < size) {
+      size_t n = std::min(filled, size - filled);
+      std::memcpy(dst + filled, dst, n);
+      filled += n;
+    }
+  }
+
+  // A copy of a region of rows and slices between pitched memory, or a
+  // fill of a flat region when there is a pattern line.
+  struct Transfer {
+    char* dst;
+    const char* src;
+    const char* line;
+    size_t pattern_size;
+    size_t region[3];           // bytes per row, rows, slices
+    size_t dst_pitch[2];        // row and slice pitch
+    size_t src_pitch[2];
+    bool stream;
+    int parts;
+  };
+
+  // does the part'th share of a transfer: a range of rows, or of the
+  // bytes of a single row
+  void transferPart(void* opaque, int part)
+  {
+    const Transfer& t = *static_cast<const Transfer*>(opaque);
+    size_t rows = t.region[1] * t.region[2];
+    if (rows == 1) {
+      // parts start at multiples of the line, keeping the pattern's phase
+      size_t size = t.region[0];
+      size_t begin = size * part / t.parts / fill_line_size * fill_line_size;
+      size_t end = part + 1 == t.parts ? size : size * (part + 1) / t.parts / fill_line_size * fill_line_size;
+      if (t.line) {
+        fillBytes(t.dst + begin, t.line, t.pattern_size, end - begin, t.stream);
+      } else {
+        copyBytes(t.dst + begin, t.src + begin, end - begin, t.stream);
+      }
+      return;
+    }
+    for (size_t row = rows * part / t.parts; row < rows * (part + 1) / t.parts; ++row) {
+      size_t y = row % t.region[1];
+      size_t z = row / t.region[1];
+      copyBytes(t.dst + z * t.dst_pitch[1] + y * t.dst_pitch[0],
+                t.src + z * t.src_pitch[1] + y * t.src_pitch[0],
+                t.region[0], t.stream);
+    }
+  }
+
+  class TransferCommand : public Command {
+  public:
+    // a copy of size bytes
+    TransferCommand(cl_context context, void* dst, const void* src, size_t size) :
+      context(context) {
+      init(dst, src, size);
+    }
+
+    // a copy of a region between pitched memory
+    TransferCommand(cl_context context, void* dst, const void* src, const size_t region[3],
+                    const size_t dst_pitch[2], const size_t src_pitch[2]) :
+      context(context) {
+      init(dst, src, region[0]);
+      for (int i = 0; i < 2; ++i) {
+        transfer.region[i + 1] = region[i + 1];
+        transfer.dst_pitch[i] = dst_pitch[i];
+        transfer.src_pitch[i] = src_pitch[i];
+      }
+    }
+
+    // a fill of size bytes with a pattern
+    TransferCommand(cl_context context, void* dst, const void* pattern, size_t pattern_size, size_t size) :
+      context(context) {
+      init(dst, NULL, size);
+      for (size_t i = 0; i < fill_line_size; i += pattern_size) {
+        std::memcpy(line + i, pattern, pattern_size);
+      }
+      transfer.line = line;
+      transfer.pattern_size = pattern_size;
+    }
+
+    virtual void execute() {
+      // reading or writing a buffer's host pointer into itself
+      if (transfer.dst == transfer.src &&
+          transfer.dst_pitch[0] == transfer.src_pitch[0] &&
+          transfer.dst_pitch[1] == transfer.src_pitch[1]) {
+        return;
+      }
+      size_t total = transfer.region[0] * transfer.region[1] * transfer.region[2];
+      // streaming only pays off when the data would not stay in cache
+      transfer.stream = total >= hostInfo().cache_size / 2;
+      transfer.parts = 1;
+      WorkerPool& workers = context->workers;
+      if (total >= parallel_transfer_size) {
+        transfer.parts = std::max<size_t>(1, std::min<size_t>(workers.size(), total / transfer_part_size));
+      }
+      // the threads of a sub-device's context stay on its cores
+      if (transfer.parts == 1 && !context->pinned) {
+        transferPart(&transfer, 0);
+      } else {
+        workers.run(transferPart, &transfer, transfer.parts);
+      }
+    }
+
+  private:
+    void init(void* dst, const void* src, size_t size) {
+      transfer.dst = static_cast<char*>(dst);
+      transfer.src = static_cast<const char*>(src);
+      transfer.line = NULL;
+      transfer.pattern_size = 0;
+      transfer.region[0] = size;
+      transfer.region[1] = 1;
+      transfer.region[2] = 1;
+      transfer.dst_pitch[0] = transfer.dst_pitch[1] = size;
+      transfer.src_pitch[0] = transfer.src_pitch[1] = size;
+    }
+
+    cl_context context;
+    Transfer transfer;
+    char line[fill_line_size];
+  };
+
+  // marks the point where all commands before it have finished
+  class MarkerCommand : public Command {
+  public:
+    virtual void execute() {
+    }
+  };
+
+  void* queueMain(void* opaque)
+  {
+    cl_command_queue queue = static_cast<cl_command_queue>(opaque);
+    if (queue->context->pinned) {
+      pinThread(queue->context->cpus);
+    }
+    pthread_mutex_lock(&queue->mutex);
+    while (true) {
+      while (queue->commands.empty() && !queue->quit) {
+        pthread_cond_wait(&queue->cond, &queue->mutex);
+      }
+      if (queue->commands.empty()) {
+        break;
+      }
+      Command* command = queue->commands.front();
+      pthread_mutex_unlock(&queue->mutex);
+
+      setEventStatus(command->event, CL_SUBMITTED);
+      for (size_t i = 0; i < command->wait_list.size(); ++i) {
+        waitEvent(command->wait_list[i]);
+      }
+      setEventStatus(command->event, CL_RUNNING);
+      command->execute();
+      setEventStatus(command->event, CL_COMPLETE);
+
+      pthread_mutex_lock(&queue->mutex);
+      queue->commands.pop_front();
+      delete command;
+      pthread_cond_broadcast(&queue->cond);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return NULL;
+  }
+
+  // Hands the command over to the queue. If event is given, it receives
+  // a new reference to the event of the command. If blocking, returns
+  // only after the command has finished.
+  cl_int enqueue(cl_command_queue queue,
+                 Command* command,
+                 cl_uint num_events_in_wait_list,
+                 const cl_event *event_wait_list,
+                 cl_event *event,
+                 bool blocking)
+  {
+    assert(queue);
+    assert(num_events_in_wait_list == 0 || event_wait_list);
+    for (cl_uint i = 0; i < num_events_in_wait_list; ++i) {
+      retainEvent(event_wait_list[i]);
+      command->wait_list.push_back(event_wait_list[i]);
+    }
+    cl_event command_event = command->event;
+    if (queue->profiling) {
+      command_event->profiling = true;
+      command_event->times[CL_PROFILING_COMMAND_QUEUED] = nanoTime();
+    }
+    retainEvent(command_event);
+    if (event) {
+      retainEvent(command_event);
+      *event = command_event;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    queue->commands.push_back(command);
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+
+    if (blocking) {
+      waitEvent(command_event);
+    }
+    releaseEvent(command_event);
+    return CL_SUCCESS;
+  }
 }
 
 extern "C" {
@@ -61,6 +1130,42 @@ void fakeclSetKernelFunc(const char* label, fakecl_kernel_fn fn)
   fakecl_kernel_funcs[label] = fn;
 }
 
+void fakeclSetKernelEntry(const char* label, fakecl_kernel_entry entry)
+{
+  fakecl_kernel_entries[label] = entry;
+}
+
+cl_int fakeclWriteClampProfile(const char* path)
+{
+  FILE* file = fopen(path, "w");
+  if (!file) {
+    return CL_INVALID_VALUE;
+  }
+  fprintf(file, "# id executions failures access function file:line:column\n");
+  pthread_mutex_lock(&clamp_profiles_mutex);
+  for (size_t p = 0; p < clamp_profiles.size(); ++p) {
+    const ClampProfile& profile = clamp_profiles[p];
+    for (int i = 0; i < profile.check_count; ++i) {
+      const ClampCheck& check = profile.checks[i];
+      fprintf(file, "%d %llu %llu %s %s %s:%d:%d\n", i,
+              (unsigned long long) profile.counters[i][0],
+              (unsigned long long) profile.counters[i][1],
+              check.is_store ? "store" : "load", check.function,
+              check.file[0] ? check.file : "?", check.line, check.column);
+    }
+  }
+  pthread_mutex_unlock(&clamp_profiles_mutex);
+  return fclose(file) == 0 ? CL_SUCCESS : CL_INVALID_VALUE;
+}
+
+void fakeclSetClampViolationHandler(fakecl_violation_handler handler, void* user_data)
+{
+  pthread_mutex_lock(&telemetry_mutex);
+  violation_handler = handler;
+  violation_handler_data = user_data;
+  pthread_mutex_unlock(&telemetry_mutex);
+}
+
 cl_context clCreateContext(cl_context_properties *properties,
                            cl_uint num_devices,
                            const cl_device_id *devices,
@@ -73,10 +1178,30 @@ cl_context clCreateContext(cl_context_properties *properties,
                            void *user_data,
                            cl_int *errcode_ret)
 {
+  // the context runs on the CPUs of all of its devices
+  std::vector<int> cpus;
+  Device device;
+  cl_device_id id = num_devices ? devices[0] : 0;
+  for (cl_uint i = 0; i < num_devices; ++i) {
+    if (!getDevice(devices[i], device)) {
+      if (errcode_ret) {
+        *errcode_ret = CL_INVALID_DEVICE;
+      }
+      return NULL;
+    }
+    cpus.insert(cpus.end(), device.cpus.begin(), device.cpus.end());
+  }
+  if (num_devices > 1) {
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    device = makeDevice(cpus, -1);
+  } else if (!num_devices) {
+    getDevice(0, device);
+  }
   if (errcode_ret) {
     *errcode_ret = CL_SUCCESS;
   }
-  return 1;
+  return new cl_context_struct(device, id);
 }
 
 cl_context clCreateContextFromType(cl_context_properties   *properties,
@@ -88,10 +1213,7 @@ cl_context clCreateContextFromType(cl_context_properties   *properties,
                                    void  *user_data,
                                    cl_int  *errcode_ret)
 {
-  if (errcode_ret) {
-    *errcode_ret = CL_SUCCESS;
-  }
-  return 1;
+  return clCreateContext(properties, 0, NULL, NULL, user_data, errcode_ret);
 }
 
 cl_int clGetContextInfo(cl_context context,
@@ -102,18 +1224,25 @@ cl_int clGetContextInfo(cl_context context,
 {
   switch (param_name) {
   case CL_CONTEXT_REFERENCE_COUNT: R(cl_uint, 1);
-  case CL_CONTEXT_DEVICES:         R(cl_uint, 0);
+  case CL_CONTEXT_DEVICES:         R(cl_device_id, context->device);
   case CL_CONTEXT_PROPERTIES:      assert(false);
   }
   assert(false);
 }
 
-cl_command_queue clCreateCommandQueue(cl_context, cl_device_id, int, int* ret)
+cl_command_queue clCreateCommandQueue(cl_context context, cl_device_id, int properties, int* ret)
 {
+  cl_command_queue queue = new cl_command_queue_struct;
+  queue->context = context ? context : defaultContext();
+  queue->profiling = (properties & CL_QUEUE_PROFILING_ENABLE) != 0;
+  pthread_mutex_init(&queue->mutex, NULL);
+  pthread_cond_init(&queue->cond, NULL);
+  queue->quit = false;
+  pthread_create(&queue->thread, NULL, queueMain, queue);
   if (ret) {
     *ret = CL_SUCCESS;
   }
-  return 1;
+  return queue;
 }
 
 cl_mem clCreateBuffer(cl_context context,
@@ -122,30 +1251,76 @@ cl_mem clCreateBuffer(cl_context context,
                       void *host_ptr,
                       cl_int *errcode_ret)
 {
-  cl_mem_info m;
-  if (!host_ptr) {
-    host_ptr = (void*) new char*[size];
-    m.do_delete = true;
+  if (!context) {
+    if (errcode_ret) {
+      *errcode_ret = CL_INVALID_CONTEXT;
+    }
+    return NULL;
+  }
+  bool use_host_ptr = flags & CL_MEM_USE_HOST_PTR;
+  bool copy_host_ptr = flags & CL_MEM_COPY_HOST_PTR;
+  if ((use_host_ptr || copy_host_ptr) != (host_ptr != NULL) ||
+      (use_host_ptr && (copy_host_ptr || (flags & CL_MEM_ALLOC_HOST_PTR)))) {
+    if (errcode_ret) {
+      *errcode_ret = CL_INVALID_HOST_PTR;
+    }
+    return NULL;
+  }
+
+  // the device is the host, so a buffer using host memory is just an
+  // alias for it and CL_MEM_ALLOC_HOST_PTR is what every buffer gets
+  cl_mem m = new cl_mem_struct;
+  if (use_host_ptr) {
+    m->ptr = host_ptr;
+    m->capacity = size;
+    m->do_delete = false;
+    m->node = -1;
   } else {
-    m.do_delete = false;
+    bool fresh;
+    m->node = context->node;
+    m->ptr = buffer_pool.allocate(size, m->node, m->capacity, fresh);
+    m->do_delete = true;
+    if (!m->ptr) {
+      delete m;
+      if (errcode_ret) {
+        *errcode_ret = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+      }
+      return NULL;
+    }
+    if (fresh && context->pinned) {
+      // the first touch of the pages happens on the context's own cores,
+      // which puts them on its NUMA node
+      if (copy_host_ptr) {
+        TransferCommand(context, m->ptr, host_ptr, size).execute();
+      } else {
+        char zero = 0;
+        TransferCommand(context, m->ptr, &zero, 1, m->capacity).execute();
+      }
+    } else if (copy_host_ptr) {
+      std::memcpy(m->ptr, host_ptr, size);
+    }
   }
-  m.ptr = host_ptr;
-  m.size = size;
+  m->size = size;
   if (errcode_ret) {
     *errcode_ret = CL_SUCCESS;
   }
-  cl_mem_data[host_ptr] = m;
-  return host_ptr;
+  pthread_mutex_lock(&live_buffers_mutex);
+  live_buffers.insert(m);
+  pthread_mutex_unlock(&live_buffers_mutex);
+  return m;
 }
 
 cl_int clReleaseMemObject(cl_mem memobj)
 {
-  assert(cl_mem_data.count(memobj));
-  cl_mem_info& info = cl_mem_data[memobj];
-  if (info.do_delete) {
-    delete[] (char*) info.ptr;
+  pthread_mutex_lock(&live_buffers_mutex);
+  assert(live_buffers.count(memobj));
+  live_buffers.erase(memobj);
+  pthread_mutex_unlock(&live_buffers_mutex);
+  if (memobj->do_delete) {
+    buffer_pool.release(memobj->ptr, memobj->node, memobj->capacity);
   }
-  cl_mem_data.erase(memobj);
+  delete memobj;
+  return CL_SUCCESS;
 }
 
 cl_int clEnqueueWriteBuffer(cl_command_queue command_queue,
@@ -158,38 +1333,521 @@ cl_int clEnqueueWriteBuffer(cl_command_queue command_queue,
                             const cl_event *event_wait_list,
                             cl_event *event)
 {
-  if (ptr != (char*) buffer + offset) {
-    std::memcpy((char*) buffer + offset, ptr, cb);
+  if (offset + cb > buffer->size) {
+    return CL_INVALID_VALUE;
   }
-  return CL_SUCCESS;
+  return enqueue(command_queue, new TransferCommand(command_queue->context, (char*) buffer->ptr + offset, ptr, cb),
+                 num_events_in_wait_list, event_wait_list, event, blocking_write);
 }
 
-cl_int clEnqueueReadBuffer(cl_command_queue command_queue,
-                           cl_mem buffer,
-                           cl_bool blocking_read,
-                           size_t offset,
-                           size_t cb,
-                           void *ptr,
-                           cl_uint num_events_in_wait_list,
-                           const cl_event *event_wait_list,
-                           cl_event *event)
-{
-  if (ptr != (char*) buffer + offset) {
-    std::memcpy(ptr, (char*) buffer + offset, cb);
+cl_int clEnqueueReadBuffer(cl_command_queue command_queue,
+                           cl_mem buffer,
+                           cl_bool blocking_read,
+                           size_t offset,
+                           size_t cb,
+                           void *ptr,
+                           cl_uint num_events_in_wait_list,
+                           const cl_event *event_wait_list,
+                           cl_event *event)
+{
+  if (offset + cb > buffer->size) {
+    return CL_INVALID_VALUE;
+  }
+  return enqueue(command_queue, new TransferCommand(command_queue->context, ptr, (char*) buffer->ptr + offset, cb),
+                 num_events_in_wait_list, event_wait_list, event, blocking_read);
+}
+
+cl_int clEnqueueCopyBuffer(cl_command_queue command_queue,
+                           cl_mem src_buffer,
+                           cl_mem dst_buffer,
+                           size_t src_offset,
+                           size_t dst_offset,
+                           size_t cb,
+                           cl_uint num_events_in_wait_list,
+                           const cl_event *event_wait_list,
+                           cl_event *event)
+{
+  if (src_offset + cb > src_buffer->size || dst_offset + cb > dst_buffer->size) {
+    return CL_INVALID_VALUE;
+  }
+  if (src_buffer == dst_buffer &&
+      src_offset < dst_offset + cb && dst_offset < src_offset + cb) {
+    return CL_MEM_COPY_OVERLAP;
+  }
+  return enqueue(command_queue,
+                 new TransferCommand(command_queue->context, (char*) dst_buffer->ptr + dst_offset,
+                                     (char*) src_buffer->ptr + src_offset, cb),
+                 num_events_in_wait_list, event_wait_list, event, false);
+}
+
+cl_int clEnqueueFillBuffer(cl_command_queue command_queue,
+                           cl_mem buffer,
+                           const void *pattern,
+                           size_t pattern_size,
+                           size_t offset,
+                           size_t cb,
+                           cl_uint num_events_in_wait_list,
+                           const cl_event *event_wait_list,
+                           cl_event *event)
+{
+  bool power_of_two = pattern_size && (pattern_size & (pattern_size - 1)) == 0;
+  if (!power_of_two || pattern_size > 128 ||
+      offset % pattern_size || cb % pattern_size || offset + cb > buffer->size) {
+    return CL_INVALID_VALUE;
+  }
+  return enqueue(command_queue,
+                 new TransferCommand(command_queue->context, (char*) buffer->ptr + offset,
+                                     pattern, pattern_size, cb),
+                 num_events_in_wait_list, event_wait_list, event, false);
+}
+
+namespace {
+  // Resolves zero pitches to the tightly packed ones and returns the
+  // offset of origin.
+  size_t rectOffset(const size_t origin[3], const size_t region[3], size_t& row_pitch, size_t& slice_pitch)
+  {
+    if (!row_pitch) {
+      row_pitch = region[0];
+    }
+    if (!slice_pitch) {
+      slice_pitch = region[1] * row_pitch;
+    }
+    return origin[2] * slice_pitch + origin[1] * row_pitch + origin[0];
+  }
+
+  // whether the region is not empty and its rows and slices don't
+  // overlap with the resolved pitches
+  bool validRect(const size_t region[3], const size_t pitch[2])
+  {
+    return region[0] && region[1] && region[2] &&
+      pitch[0] >= region[0] && pitch[1] >= region[1] * pitch[0];
+  }
+
+  // the end of a valid region starting at offset
+  size_t rectEnd(size_t offset, const size_t region[3], const size_t pitch[2])
+  {
+    return offset + (region[2] - 1) * pitch[1] + (region[1] - 1) * pitch[0] + region[0];
+  }
+}
+
+cl_int clEnqueueWriteBufferRect(cl_command_queue command_queue,
+                                cl_mem buffer,
+                                cl_bool blocking_write,
+                                const size_t *buffer_origin,
+                                const size_t *host_origin,
+                                const size_t *region,
+                                size_t buffer_row_pitch,
+                                size_t buffer_slice_pitch,
+                                size_t host_row_pitch,
+                                size_t host_slice_pitch,
+                                const void *ptr,
+                                cl_uint num_events_in_wait_list,
+                                const cl_event *event_wait_list,
+                                cl_event *event)
+{
+  size_t dst_pitch[2] = { buffer_row_pitch, buffer_slice_pitch };
+  size_t src_pitch[2] = { host_row_pitch, host_slice_pitch };
+  size_t dst_offset = rectOffset(buffer_origin, region, dst_pitch[0], dst_pitch[1]);
+  size_t src_offset = rectOffset(host_origin, region, src_pitch[0], src_pitch[1]);
+  if (!validRect(region, dst_pitch) || !validRect(region, src_pitch) ||
+      rectEnd(dst_offset, region, dst_pitch) > buffer->size) {
+    return CL_INVALID_VALUE;
+  }
+  return enqueue(command_queue,
+                 new TransferCommand(command_queue->context, (char*) buffer->ptr + dst_offset,
+                                     (const char*) ptr + src_offset, region, dst_pitch, src_pitch),
+                 num_events_in_wait_list, event_wait_list, event, blocking_write);
+}
+
+cl_int clEnqueueReadBufferRect(cl_command_queue command_queue,
+                               cl_mem buffer,
+                               cl_bool blocking_read,
+                               const size_t *buffer_origin,
+                               const size_t *host_origin,
+                               const size_t *region,
+                               size_t buffer_row_pitch,
+                               size_t buffer_slice_pitch,
+                               size_t host_row_pitch,
+                               size_t host_slice_pitch,
+                               void *ptr,
+                               cl_uint num_events_in_wait_list,
+                               const cl_event *event_wait_list,
+                               cl_event *event)
+{
+  size_t dst_pitch[2] = { host_row_pitch, host_slice_pitch };
+  size_t src_pitch[2] = { buffer_row_pitch, buffer_slice_pitch };
+  size_t dst_offset = rectOffset(host_origin, region, dst_pitch[0], dst_pitch[1]);
+  size_t src_offset = rectOffset(buffer_origin, region, src_pitch[0], src_pitch[1]);
+  if (!validRect(region, dst_pitch) || !validRect(region, src_pitch) ||
+      rectEnd(src_offset, region, src_pitch) > buffer->size) {
+    return CL_INVALID_VALUE;
+  }
+  return enqueue(command_queue,
+                 new TransferCommand(command_queue->context, (char*) ptr + dst_offset,
+                                     (char*) buffer->ptr + src_offset, region, dst_pitch, src_pitch),
+                 num_events_in_wait_list, event_wait_list, event, blocking_read);
+}
+
+void* clEnqueueMapBuffer(cl_command_queue command_queue,
+                         cl_mem buffer,
+                         cl_bool blocking_map,
+                         cl_map_flags map_flags,
+                         size_t offset,
+                         size_t cb,
+                         cl_uint num_events_in_wait_list,
+                         const cl_event *event_wait_list,
+                         cl_event *event,
+                         cl_int *errcode_ret)
+{
+  if (offset + cb > buffer->size) {
+    if (errcode_ret) {
+      *errcode_ret = CL_INVALID_VALUE;
+    }
+    return NULL;
+  }
+  // the mapping only needs to wait for the commands before it
+  cl_int ret = enqueue(command_queue, new MarkerCommand,
+                       num_events_in_wait_list, event_wait_list, event, blocking_map);
+  if (errcode_ret) {
+    *errcode_ret = ret;
+  }
+  return (char*) buffer->ptr + offset;
+}
+
+cl_int clEnqueueUnmapMemObject(cl_command_queue command_queue,
+                               cl_mem memobj,
+                               void *mapped_ptr,
+                               cl_uint num_events_in_wait_list,
+                               const cl_event *event_wait_list,
+                               cl_event *event)
+{
+  return enqueue(command_queue, new MarkerCommand,
+                 num_events_in_wait_list, event_wait_list, event, false);
+}
+
+// Source or LLVM IR given to the program, and the kernels built from it
+// by clBuildProgram when FAKECL_COMPILE is set. Otherwise the kernels
+// are the ones linked into the executable.
+struct cl_program_struct {
+  std::string source;           // OpenCL C, or LLVM IR when is_binary
+  bool is_binary;
+  std::string binary;           // LLVM IR the kernels were built from
+  std::string log;
+  void* library;                // dlopen handle of the built kernels
+};
+
+namespace {
+  // 64-bit FNV-1a, continuing from hash
+  uint64_t fnv1a(uint64_t hash, const std::string& data)
+  {
+    for (size_t i = 0; i < data.size(); ++i) {
+      hash ^= (unsigned char) data[i];
+      hash *= 1099511628211ULL;
+    }
+    // separates consecutive strings
+    hash ^= 0xff;
+    return hash * 1099511628211ULL;
+  }
+
+  std::string getEnv(const char* name)
+  {
+    const char* value = getenv(name);
+    return value ? value : "";
+  }
+
+  bool writeFile(const std::string& path, const std::string& contents)
+  {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+      return false;
+    }
+    bool ok = fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+    return fclose(file) == 0 && ok;
+  }
+
+  // appends the words of flags, which are separated by whitespace and
+  // not quoted
+  void addFlags(std::vector<std::string>& command, const std::string& flags)
+  {
+    size_t end = 0;
+    while (true) {
+      size_t begin = flags.find_first_not_of(" \t\n", end);
+      if (begin == std::string::npos) {
+        break;
+      }
+      end = flags.find_first_of(" \t\n", begin);
+      command.push_back(flags.substr(begin, end == std::string::npos ? end : end - begin));
+    }
+  }
+
+  // the optimization level build options ask for: that of their last -O
+  // flag, 0 for -cl-opt-disable, and otherwise 3, as OpenCL programs are
+  // optimized unless the options say not to. Size levels become 2, which
+  // llc takes instead.
+  char optimizationLevel(const std::string& options)
+  {
+    std::vector<std::string> words;
+    addFlags(words, options);
+    char level = '3';
+    for (size_t i = 0; i < words.size(); ++i) {
+      if (words[i] == "-cl-opt-disable") {
+        level = '0';
+      } else if (words[i].size() == 3 && words[i].compare(0, 2, "-O") == 0 &&
+                 strchr("0123sz", words[i][2])) {
+        level = words[i][2];
+      }
+    }
+    return level == 's' || level == 'z' ? '2' : level;
+  }
+
+  // the size and modification time of a file, which change when it is
+  // rebuilt, or nothing if there is no such file
+  std::string fileStamp(const std::string& path)
+  {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+      return "";
+    }
+    char stamp[64];
+    snprintf(stamp, sizeof(stamp), "%lld %lld.%09ld", (long long) st.st_size,
+             (long long) st.st_mtim.tv_sec, (long) st.st_mtim.tv_nsec);
+    return stamp;
+  }
+
+  // runs a tool without a shell, so that paths are never split or
+  // expanded, appending the command and its output to the log
+  bool runStep(cl_program program, const std::vector<std::string>& command, const std::string& log_path)
+  {
+    std::vector<char*> argv;
+    for (size_t i = 0; i < command.size(); ++i) {
+      program->log += (i ? " " : "") + command[i];
+      argv.push_back(const_cast<char*>(command[i].c_str()));
+    }
+    program->log += "\n";
+    argv.push_back(NULL);
+
+    int status = -1;
+    int log = open(log_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    pid_t pid = log < 0 ? -1 : fork();
+    if (pid == 0) {
+      dup2(log, 1);
+      dup2(log, 2);
+      execvp(argv[0], &argv[0]);
+      fprintf(stderr, "cannot run %s\n", argv[0]);
+      _exit(127);
+    }
+    if (pid > 0) {
+      while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+      }
+    }
+    if (log >= 0) {
+      close(log);
+    }
+    std::string output;
+    if (readFile(log_path, output)) {
+      program->log += output;
+    }
+    unlink(log_path.c_str());
+    return pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  }
+
+  // Compiles the program into a shared library in the cache directory
+  // unless it is already there, and loads it:
+  //
+  // 1. clang compiles OpenCL C to LLVM IR, with FAKECL_CLANG_FLAGS and the
+  //    build options, which choose the optimization level too; skipped
+  //    for a program created from IR
+  // 2. llvm-link adds the bitcode files in FAKECL_LINK, if any
+  // 3. when CLAMP_PLUGIN is set, opt runs FAKECL_PLUGIN_PASSES, by default
+  //    clamp-pointers and fakecl-entry-thunks
+  // 4. opt at the level the options choose, see optimizationLevel, or
+  //    with FAKECL_OPT_FLAGS if it is set; skipped at -O0 or when
+  //    FAKECL_OPT_FLAGS is set empty
+  // 5. llc at the same level with FAKECL_LLC_FLAGS, and cc -shared
+  //
+  // The cache is keyed by the source, options and the tools' settings,
+  // and the size and modification time of the plugin and linked files, so
+  // a program is compiled once for all processes sharing FAKECL_CACHE_DIR
+  // and again when the plugin or a library is rebuilt.
+  cl_int compileProgram(cl_program program, const std::string& options)
+  {
+    std::string cache_dir = getEnv("FAKECL_CACHE_DIR");
+    if (cache_dir.empty()) {
+      char dir[64];
+      snprintf(dir, sizeof(dir), "/tmp/fakecl-cache-%d", (int) getuid());
+      cache_dir = dir;
+    }
+    mkdir(cache_dir.c_str(), 0700);
+
+    std::string clang_flags = getEnv("FAKECL_CLANG_FLAGS");
+    std::string link = getEnv("FAKECL_LINK");
+    std::string plugin = getEnv("CLAMP_PLUGIN");
+    std::string plugin_passes = getEnv("FAKECL_PLUGIN_PASSES");
+    if (plugin_passes.empty()) {
+      plugin_passes = "-clamp-pointers -clamp-pointers-thread-local-locals -fakecl-entry-thunks";
+    }
+    std::string llc_flags = getEnv("FAKECL_LLC_FLAGS");
+    char level = optimizationLevel(options);
+    const char* opt_env = getenv("FAKECL_OPT_FLAGS");
+    std::string opt_flags = opt_env ? opt_env : level == '0' ? "" : std::string("-O") + level;
+    uint64_t hash = 14695981039346656037ULL;
+    hash = fnv1a(hash, program->is_binary ? "ir" : "cl");
+    hash = fnv1a(hash, program->source);
+    hash = fnv1a(hash, options);
+    hash = fnv1a(hash, clang_flags);
+    hash = fnv1a(hash, link);
+    std::vector<std::string> linked;
+    addFlags(linked, link);
+    for (size_t i = 0; i < linked.size(); ++i) {
+      hash = fnv1a(hash, fileStamp(linked[i]));
+    }
+    hash = fnv1a(hash, plugin);
+    hash = fnv1a(hash, fileStamp(plugin));
+    hash = fnv1a(hash, plugin_passes);
+    hash = fnv1a(hash, opt_flags);
+    hash = fnv1a(hash, llc_flags);
+    char key[32];
+    snprintf(key, sizeof(key), "%016llx", (unsigned long long) hash);
+
+    std::string base = cache_dir + "/" + key;
+    std::string library = base + ".so";
+    std::string ir = base + ".ll";
+    double start = nanoTime();
+    bool cached = access(library.c_str(), R_OK) == 0 && readFile(ir, program->binary);
+    if (!cached) {
+      // intermediate files are private to this process until renamed
+      char pid[32];
+      snprintf(pid, sizeof(pid), ".%d", (int) getpid());
+      std::string tmp = base + pid;
+      std::string log_path = tmp + ".log";
+      bool ok = true;
+      if (program->is_binary) {
+        ok = writeFile(tmp + ".ll", program->source);
+      } else {
+        std::vector<std::string> clang;
+        clang.push_back("clang");
+        addFlags(clang, "-x cl -fno-builtin -DFAKECL=1");
+        addFlags(clang, clang_flags);
+        addFlags(clang, options);
+        addFlags(clang, "-S -emit-llvm -o");
+        clang.push_back(tmp + ".ll");
+        clang.push_back(tmp + ".cl");
+        ok = writeFile(tmp + ".cl", program->source) && runStep(program, clang, log_path);
+      }
+      std::string optimized_input = tmp + ".ll";
+      if (ok && !link.empty()) {
+        std::vector<std::string> llvm_link;
+        addFlags(llvm_link, "llvm-link -S -o");
+        llvm_link.push_back(tmp + ".linked.ll");
+        llvm_link.push_back(optimized_input);
+        addFlags(llvm_link, link);
+        ok = runStep(program, llvm_link, log_path);
+        optimized_input = tmp + ".linked.ll";
+      }
+      if (ok && !plugin.empty()) {
+        std::vector<std::string> clamp;
+        addFlags(clamp, "opt -load");
+        clamp.push_back(plugin);
+        addFlags(clamp, plugin_passes);
+        addFlags(clamp, "-S -o");
+        clamp.push_back(tmp + ".clamped.ll");
+        clamp.push_back(optimized_input);
+        ok = runStep(program, clamp, log_path);
+        optimized_input = tmp + ".clamped.ll";
+      }
+      std::string final_ir = optimized_input;
+      if (ok && opt_flags.find_first_not_of(" \t\n") != std::string::npos) {
+        std::vector<std::string> opt;
+        opt.push_back("opt");
+        addFlags(opt, opt_flags);
+        addFlags(opt, "-S -o");
+        opt.push_back(tmp + ".opt.ll");
+        opt.push_back(optimized_input);
+        ok = runStep(program, opt, log_path);
+        final_ir = tmp + ".opt.ll";
+      }
+      std::vector<std::string> llc;
+      llc.push_back("llc");
+      llc.push_back(std::string("-O") + level);
+      addFlags(llc, "-relocation-model=pic -filetype=obj");
+      addFlags(llc, llc_flags);
+      llc.push_back("-o");
+      llc.push_back(tmp + ".o");
+      llc.push_back(final_ir);
+      std::vector<std::string> cc;
+      addFlags(cc, "cc -shared -o");
+      cc.push_back(tmp + ".so");
+      cc.push_back(tmp + ".o");
+      ok = ok &&
+        runStep(program, llc, log_path) &&
+        runStep(program, cc, log_path) &&
+        readFile(final_ir, program->binary) &&
+        rename(final_ir.c_str(), ir.c_str()) == 0 &&
+        rename((tmp + ".so").c_str(), library.c_str()) == 0;
+
+      const char* suffixes[] = { ".cl", ".ll", ".linked.ll", ".clamped.ll", ".opt.ll", ".o", ".so" };
+      for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); ++i) {
+        unlink((tmp + suffixes[i]).c_str());
+      }
+      if (!ok) {
+        return CL_BUILD_PROGRAM_FAILURE;
+      }
+    }
+
+    // the kernels' builtins resolve against the executable, which must
+    // export them (-rdynamic)
+    program->library = dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!program->library) {
+      program->log += std::string(dlerror()) + "\n";
+      return CL_BUILD_PROGRAM_FAILURE;
+    }
+
+    char timing[96];
+    snprintf(timing, sizeof(timing), "fakecl: built %s in %.3f ms%s\n",
+             key, (nanoTime() - start) / 1e6, cached ? " (cached)" : "");
+    program->log += timing;
+    return CL_SUCCESS;
   }
-  return CL_SUCCESS;
 }
 
 cl_kernel clCreateKernel (cl_program  program,
                           const char *kernel_name,
                           cl_int *errcode_ret)
 {
+  // prefer an entry thunk, from the built program, registered or exported
+  // by the executable
+  std::string name = kernel_name;
+  std::string entry_name = "__fakecl_entry_" + name;
   cl_kernel k = new cl_kernel_struct;
-  k->fn = fakecl_kernel_funcs[kernel_name];
-  assert(k->fn);
-  k->arg_count = 0;
+  k->entry = NULL;
+  k->fn = NULL;
+  void* library = RTLD_DEFAULT;
+  if (program && program->library) {
+    k->entry = (fakecl_kernel_entry) dlsym(program->library, entry_name.c_str());
+    k->fn = (fakecl_kernel_fn) dlsym(program->library, name.c_str());
+    library = program->library;
+  }
+  if (!k->entry && !k->fn) {
+    k->entry = fakecl_kernel_entries.count(name) ? fakecl_kernel_entries[name] : NULL;
+    if (!k->entry) {
+      k->entry = (fakecl_kernel_entry) dlsym(RTLD_DEFAULT, entry_name.c_str());
+    }
+    k->fn = fakecl_kernel_funcs.count(name) ? fakecl_kernel_funcs[name] : NULL;
+  }
+  // exported next to the entry thunk
+  const int* param_count = (const int*) dlsym(library, ("__fakecl_params_" + name).c_str());
+  k->param_count = param_count ? *param_count : -1;
+  k->pointers = param_count ? (const char*) dlsym(library, ("__fakecl_pointers_" + name).c_str()) : NULL;
+  const int* barriers = (const int*) dlsym(library, ("__fakecl_barriers_" + name).c_str());
+  k->barriers = barriers ? *barriers : -1;
+  k->profiled = registerClampProfile(library);
+  k->telemetry = findClampTelemetry(library);
+  if (!k->entry && !k->fn) {
+    delete k;
+    k = NULL;
+  }
   if (errcode_ret) {
-    *errcode_ret = CL_SUCCESS;
+    *errcode_ret = k ? CL_SUCCESS : CL_INVALID_KERNEL_NAME;
   }
   return k;
 }
@@ -200,10 +1858,45 @@ cl_program clCreateProgramWithSource(cl_context context,
                                      const size_t *lengths,
                                      cl_int *errcode_ret)
 {
-  if (*errcode_ret) {
+  cl_program program = new cl_program_struct;
+  program->is_binary = false;
+  program->library = NULL;
+  for (cl_uint i = 0; i < count; ++i) {
+    if (lengths && lengths[i]) {
+      program->source.append(strings[i], lengths[i]);
+    } else {
+      program->source.append(strings[i]);
+    }
+  }
+  if (errcode_ret) {
     *errcode_ret = CL_SUCCESS;
   }
-  return 1;
+  return program;
+}
+
+cl_program clCreateProgramWithBinary(cl_context context,
+                                     cl_uint num_devices,
+                                     const cl_device_id *device_list,
+                                     const size_t *lengths,
+                                     const unsigned char **binaries,
+                                     cl_int *binary_status,
+                                     cl_int *errcode_ret)
+{
+  cl_int status = num_devices == 1 && lengths[0] ? CL_SUCCESS : CL_INVALID_BINARY;
+  cl_program program = NULL;
+  if (status == CL_SUCCESS) {
+    program = new cl_program_struct;
+    program->is_binary = true;
+    program->source.assign((const char*) binaries[0], lengths[0]);
+    program->library = NULL;
+  }
+  if (binary_status) {
+    *binary_status = status;
+  }
+  if (errcode_ret) {
+    *errcode_ret = status;
+  }
+  return program;
 }
 
 cl_int clBuildProgram(cl_program program,
@@ -213,7 +1906,15 @@ cl_int clBuildProgram(cl_program program,
                       void (*pfn_notify)(cl_program, void *user_data),
                       void *user_data)
 {
-  return CL_SUCCESS;
+  cl_int status = CL_SUCCESS;
+  if (!getEnv("FAKECL_COMPILE").empty() && !program->library) {
+    program->log.clear();
+    status = compileProgram(program, options ? options : "");
+  }
+  if (pfn_notify) {
+    pfn_notify(program, user_data);
+  }
+  return status;
 }
 
 cl_int clGetProgramBuildInfo(cl_program  program,
@@ -224,130 +1925,488 @@ cl_int clGetProgramBuildInfo(cl_program  program,
                              size_t  *param_value_size_ret)
 {
   switch (param_name) {
-  case CL_PROGRAM_BUILD_LOG: RS("");
+  case CL_PROGRAM_BUILD_LOG:
+    if (param_value_size_ret) {
+      *param_value_size_ret = program->log.size() + 1;
+    }
+    if (param_value && program->log.size() < param_value_size) {
+      std::memcpy(param_value, program->log.c_str(), program->log.size() + 1);
+    }
+    return CL_SUCCESS;
+  }
+  return CL_INVALID_VALUE;
+}
+
+cl_int clGetProgramInfo(cl_program program,
+                        cl_program_info param_name,
+                        size_t param_value_size,
+                        void *param_value,
+                        size_t *param_value_size_ret)
+{
+  switch (param_name) {
+  case CL_PROGRAM_NUM_DEVICES: R(cl_uint, 1);
+  case CL_PROGRAM_BINARY_SIZES: R(size_t, program->binary.size());
+  case CL_PROGRAM_BINARIES:
+    if (param_value_size_ret) {
+      *param_value_size_ret = sizeof(unsigned char*);
+    }
+    if (param_value && sizeof(unsigned char*) <= param_value_size) {
+      std::memcpy(*(unsigned char**) param_value, program->binary.data(), program->binary.size());
+    }
+    return CL_SUCCESS;
   }
+  return CL_INVALID_VALUE;
 }
 
 namespace {
-  struct EnqeueuKernelInfo {
-    cl_kernel_struct* kernel;
-    const size_t* local_work_size;
-    int group_id;
-    int local_id;
+  // The shape of a launch. Dimensions beyond work_dim have size 1, so
+  // the builtins need no special cases for them.
+  struct NDRange {
+    cl_uint work_dim;
+    size_t global_offset[3];
+    size_t global_size[3];
+    size_t local_size[3];
+    size_t num_groups[3];
   };
 
-  pthread_key_t thread_info_key;
-  pthread_once_t thread_info_key_once;
+  struct WorkItem {
+    size_t global_id[3];
+    size_t local_id[3];
+    size_t group_id[3];
+    int local_index;        // local id flattened, x fastest
+  };
+
+  // The work-item running on this thread and the range of its launch,
+  // kept by value so that the builtins are a single thread-local load.
+  // The runner copies a work-item in before switching to it.
+  __thread NDRange current_range;
+  __thread WorkItem current_item;
+  __thread GroupRunner* current_runner;
+
+  // A kernel and its argument block as they were when it was enqueued,
+  // so that the host may set new arguments while it waits to run.
+  struct KernelCall {
+    fakecl_kernel_entry entry;
+    fakecl_kernel_fn fn;
+    int* barriers;          // the kernel's, updated by the first group that runs
+    bool profiled;
+    ClampTelemetry telemetry;
+    std::vector<cl_arg> args;
+    char* block;
+    size_t block_size;
+
+    KernelCall(cl_kernel_struct* k) :
+      entry(k->entry),
+      fn(k->fn),
+      barriers(&k->barriers),
+      profiled(k->profiled),
+      telemetry(k->telemetry),
+      args(k->args),
+      block(NULL),
+      block_size(k->block.size()) {
+      assert(entry || args.size() <= FAKECL_MAX_ARGS);
+      if (block_size) {
+        if (posix_memalign((void**) &block, arg_block_alignment, block_size) != 0) {
+          abort();
+        }
+        std::memcpy(block, &k->block[0], block_size);
+      }
+    }
+
+    ~KernelCall() {
+      free(block);
+    }
 
-  void thread_info_key_init()
+  private:
+    // doesn't exist: the block is owned
+    KernelCall(const KernelCall&);
+    void operator=(const KernelCall&);
+  };
+
+  // calls a kernel registered with fakeclSetKernelFunc, whose arguments
+  // are each passed as one pointer-sized value
+  void callLegacyKernel(fakecl_kernel_fn fn, int arg_count, void** a)
   {
-    pthread_key_create(&thread_info_key, NULL);
+#define A(n) a[n]
+    switch (arg_count) {
+    case  0: fn(); break;
+    case  1: fn(A(0)); break;
+    case  2: fn(A(0), A(1)); break;
+    case  3: fn(A(0), A(1), A(2)); break;
+    case  4: fn(A(0), A(1), A(2), A(3)); break;
+    case  5: fn(A(0), A(1), A(2), A(3), A(4)); break;
+    case  6: fn(A(0), A(1), A(2), A(3), A(4), A(5)); break;
+    case  7: fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6)); break;
+    case  8: fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7)); break;
+    case  9: fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8)); break;
+    case 10: fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9)); break;
+    case 11: fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9), A(10)); break;
+    case 12: fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9), A(10), A(11)); break;
+    case 13: fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9), A(10), A(11), A(12)); break;
+    case 14: fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9), A(10), A(11), A(12), A(13)); break;
+    case 15: fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9), A(10), A(11), A(12), A(13), A(14)); break;
+    case 16: fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9), A(10), A(11), A(12), A(13), A(14), A(15)); break;
+    case 17: fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9), A(10), A(11), A(12), A(13), A(14), A(15), A(16)); break;
+    case 18: fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9), A(10), A(11), A(12), A(13), A(14), A(15), A(16), A(17)); break;
+    case 19: fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9), A(10), A(11), A(12), A(13), A(14), A(15), A(16), A(17), A(18)); break;
+    case 20: fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9), A(10), A(11), A(12), A(13), A(14), A(15), A(16), A(17), A(18), A(19)); break;
+    default: assert(false);
+    }
+#undef A
   }
 
-  void* getClMemArg(cl_arg& arg)
-  {
-    if (arg.data.size() == sizeof(cl_mem)) {
-      cl_mem* m = *(cl_mem**) &*arg.data.begin();
-      if (cl_mem_data.count(m)) {
-        return cl_mem_data.find(m)->second.ptr;
+  // Runs the work-items of one work-group at a time as fibers on the
+  // calling worker thread. barrier() switches from a work-item back to
+  // the runner, which resumes the next one; the group is done when
+  // every fiber has returned. All barrier state lives here and each
+  // worker has a runner of its own, so groups on different workers run
+  // in parallel.
+  struct GroupRunner {
+    ucontext_t scheduler;
+    // one for each work-item of the largest group
+    std::vector<ucontext_t> fibers;
+    std::vector<char> finished;
+    std::vector<WorkItem> items;
+    char* stacks;
+    size_t slot_size;       // fiber stack plus its guard page
+    bool barrier_seen;      // a work-item of the current group has called barrier()
+    bool looping;           // the current group runs as a loop, not as fibers
+    const KernelCall* kernel;
+    char* block;            // this worker's copy of the argument block
+    size_t block_capacity;
+    char* local_arena;      // this worker's __local arguments, for the group it runs
+    void* legacy_args[FAKECL_MAX_ARGS]; // the block unpacked for callLegacyKernel
+
+    GroupRunner() :
+      fibers(hostInfo().max_work_group_size),
+      finished(hostInfo().max_work_group_size),
+      items(hostInfo().max_work_group_size),
+      block(NULL),
+      block_capacity(0) {
+      if (posix_memalign((void**) &local_arena, localLineSize(), localArenaSize()) != 0) {
+        abort();
+      }
+      slot_size = fiber_stack_size + sysconf(_SC_PAGESIZE);
+      stacks = static_cast<char*>(mmap(NULL, slot_size * fibers.size(),
+                                       PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                       -1, 0));
+      assert(stacks != MAP_FAILED);
+      for (size_t i = 0; i < fibers.size(); ++i) {
+        // stacks grow down, so an overflow hits the guard page below
+        mprotect(stacks + i * slot_size, slot_size - fiber_stack_size, PROT_NONE);
+      }
+    }
+
+    ~GroupRunner() {
+      munmap(stacks, slot_size * fibers.size());
+      free(block);
+      free(local_arena);
+    }
+
+    // sets up the arguments once for every group this runner executes
+    // during a launch
+    void setKernel(const KernelCall* k) {
+      kernel = k;
+      if (block_capacity < k->block_size) {
+        free(block);
+        if (posix_memalign((void**) &block, arg_block_alignment, k->block_size) != 0) {
+          abort();
+        }
+        block_capacity = k->block_size;
+      }
+      if (k->block_size) {
+        std::memcpy(block, k->block, k->block_size);
+      }
+
+      // only the group running on this worker uses the arena, and
+      // clEnqueueNDRangeKernel has checked that the arguments fit
+      size_t line = localLineSize();
+      size_t arg_count = k->args.size();
+      assert(localArgsSize(k->args) <= localArenaSize());
+      char* local = local_arena;
+      for (size_t i = 0; i < arg_count; ++i) {
+        const cl_arg& arg = k->args[i];
+        if (arg.is_local) {
+          std::memcpy(block + arg.offset, &local, sizeof(void*));
+          local += (arg.local_size + line - 1) / line * line;
+        }
+        if (!k->entry) {
+          assert(arg.size <= sizeof(void*));
+          legacy_args[i] = 0;
+          std::memcpy(&legacy_args[i], block + arg.offset, arg.size);
+        }
+      }
+    }
+
+    void callKernel() {
+      if (kernel->entry) {
+        kernel->entry(block);
       } else {
-        return 0;
+        callLegacyKernel(kernel->fn, kernel->args.size(), legacy_args);
       }
-    } else {
-      return 0;
     }
+
+    // Until it is known whether the kernel calls barrier(), work-item 0
+    // runs first as a fiber. Barriers must be reached by all work-items
+    // of a group or by none, so if it returns without calling barrier()
+    // the rest of the group runs as a plain loop on the worker's own
+    // stack, with no context switches at all. The kernel remembers the
+    // outcome, so later groups and launches either loop over all of
+    // their work-items or start them all as fibers without detecting
+    // barriers again.
+    void run(const NDRange& range, size_t group_index) {
+      size_t group_id[3];
+      group_id[0] = group_index % range.num_groups[0];
+      group_id[1] = group_index / range.num_groups[0] % range.num_groups[1];
+      group_id[2] = group_index / range.num_groups[0] / range.num_groups[1];
+
+      size_t count = range.local_size[0] * range.local_size[1] * range.local_size[2];
+      for (size_t i = 0; i < count; ++i) {
+        WorkItem& item = items[i];
+        item.local_id[0] = i % range.local_size[0];
+        item.local_id[1] = i / range.local_size[0] % range.local_size[1];
+        item.local_id[2] = i / range.local_size[0] / range.local_size[1];
+        for (int d = 0; d < 3; ++d) {
+          item.group_id[d] = group_id[d];
+          item.global_id[d] = range.global_offset[d] + group_id[d] * range.local_size[d] + item.local_id[d];
+        }
+        item.local_index = i;
+      }
+      current_range = range;
+      current_runner = this;
+
+      int barriers = *(volatile int*) kernel->barriers;
+      size_t first = 0;
+      looping = false;
+      if (barriers < 0) {
+        barrier_seen = false;
+        startFiber(0);
+        current_item = items[0];
+        swapcontext(&scheduler, &fibers[0]);
+        barriers = barrier_seen;
+        __sync_bool_compare_and_swap(kernel->barriers, -1, barriers);
+        first = 1;
+      }
+
+      if (!barriers) {
+        looping = true;
+        for (size_t i = first; i < count; ++i) {
+          current_item = items[i];
+          callKernel();
+        }
+        looping = false;
+        return;
+      }
+
+      for (size_t i = first; i < count; ++i) {
+        startFiber(i);
+      }
+      // work-item 0 is started or waiting in its first barrier, so every
+      // round starts after it
+      size_t remaining = count;
+      while (remaining > 0) {
+        for (size_t j = 1; j <= count; ++j) {
+          size_t i = j % count;
+          if (finished[i]) {
+            continue;
+          }
+          current_item = items[i];
+          swapcontext(&scheduler, &fibers[i]);
+          if (finished[i]) {
+            --remaining;
+          }
+        }
+      }
+    }
+
+    // called by barrier() on the fiber of the work-item
+    void yield(int local_id) {
+      if (looping) {
+        const size_t* group_id = items[local_id].group_id;
+        fprintf(stderr, "FakeCL: work-item %d of group (%d, %d, %d) reached a barrier, but work-item 0 of the first group run returned without one\n",
+                local_id, (int) group_id[0], (int) group_id[1], (int) group_id[2]);
+        abort();
+      }
+      barrier_seen = true;
+      swapcontext(&fibers[local_id], &scheduler);
+    }
+
+    static void fiberMain(unsigned self_hi, unsigned self_lo, int local_id) {
+      GroupRunner* runner = reinterpret_cast<GroupRunner*>
+        (static_cast<uintptr_t>((static_cast<uint64_t>(self_hi) << 32) | self_lo));
+      runner->callKernel();
+      runner->finished[local_id] = true;
+      // returning switches to uc_link, the scheduler
+    }
+
+  private:
+    void startFiber(int local_id) {
+      finished[local_id] = false;
+      ucontext_t& fiber = fibers[local_id];
+      getcontext(&fiber);
+      fiber.uc_stack.ss_sp = stacks + local_id * slot_size + (slot_size - fiber_stack_size);
+      fiber.uc_stack.ss_size = fiber_stack_size;
+      fiber.uc_link = &scheduler;
+      uint64_t self = reinterpret_cast<uintptr_t>(this);
+      makecontext(&fiber, (void (*)()) fiberMain, 3,
+                  (unsigned) (self >> 32), (unsigned) self, local_id);
+    }
+
+
+    // doesn't exist: the runner is not copyable
+    GroupRunner(const GroupRunner&);
+    void operator=(const GroupRunner&);
+  };
+
+  // The groups [begin, end) still waiting to be run by a worker. The
+  // owner takes groups from the front, thieves take the back half.
+  struct GroupRange {
+    pthread_mutex_t mutex;
+    size_t begin;
+    size_t end;
+  };
+
+  struct Launch {
+    cl_context context;
+    const KernelCall* kernel;
+    NDRange range;
+    std::vector<GroupRange> ranges; // ranges[i] is owned by worker i
+  };
+
+  bool takeGroup(GroupRange& range, size_t& group_id)
+  {
+    bool taken = false;
+    pthread_mutex_lock(&range.mutex);
+    if (range.begin < range.end) {
+      group_id = range.begin++;
+      taken = true;
+    }
+    pthread_mutex_unlock(&range.mutex);
+    return taken;
   }
 
-  void* argPtr(cl_arg& arg)
+  // moves the back half of victim's groups to own, which must be empty
+  bool stealGroups(GroupRange& victim, GroupRange& own)
   {
-    void* p = getClMemArg(arg);
-    if (!p) {
-      if (arg.is_local) {
-        p = &*arg.data.begin();
-      } else if (arg.data.size()==sizeof(int)) {
-        p = *(void**) &*arg.data.begin();
-      } else {
-        assert(false);
-      }
-    } else {
+    size_t begin = 0;
+    size_t end = 0;
+    pthread_mutex_lock(&victim.mutex);
+    if (victim.begin < victim.end) {
+      end = victim.end;
+      begin = victim.end - (victim.end - victim.begin + 1) / 2;
+      victim.end = begin;
     }
-    return p;
-  }
-
-  void* clthread(void* opaque)
-  {
-    EnqeueuKernelInfo* info = static_cast<EnqeueuKernelInfo*>(opaque);
-    pthread_setspecific(thread_info_key, opaque);
-
-    cl_arg* a = info->kernel->args;
-    //#define A(n) a[n].elem_size, a[n].elem_count, a[n].data
-#define A(n)                                                            \
-    argPtr(a[n])
-
-    cl_kernel_struct* k = info->kernel;
-
-    switch (k->arg_count) {
-    case  0: k->fn(); break;
-    case  1: k->fn(A(0)); break;
-    case  2: k->fn(A(0), A(1)); break;
-    case  3: k->fn(A(0), A(1), A(2)); break;
-    case  4: k->fn(A(0), A(1), A(2), A(3)); break;
-    case  5: k->fn(A(0), A(1), A(2), A(3), A(4)); break;
-    case  6: k->fn(A(0), A(1), A(2), A(3), A(4), A(5)); break;
-    case  7: k->fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6)); break;
-    case  8: k->fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7)); break;
-    case  9: k->fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8)); break;
-    case 10: k->fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9)); break;
-    case 11: k->fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9), A(10)); break;
-    case 12: k->fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9), A(10), A(11)); break;
-    case 13: k->fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9), A(10), A(11), A(12)); break;
-    case 14: k->fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9), A(10), A(11), A(12), A(13)); break;
-    case 15: k->fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9), A(10), A(11), A(12), A(13), A(14)); break;
-    case 16: k->fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9), A(10), A(11), A(12), A(13), A(14), A(15)); break;
-    case 17: k->fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9), A(10), A(11), A(12), A(13), A(14), A(15), A(16)); break;
-    case 18: k->fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9), A(10), A(11), A(12), A(13), A(14), A(15), A(16), A(17)); break;
-    case 19: k->fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9), A(10), A(11), A(12), A(13), A(14), A(15), A(16), A(17), A(18)); break;
-    case 20: k->fn(A(0), A(1), A(2), A(3), A(4), A(5), A(6), A(7), A(8), A(9), A(10), A(11), A(12), A(13), A(14), A(15), A(16), A(17), A(18), A(19)); break;
-    default: assert(false);
+    pthread_mutex_unlock(&victim.mutex);
+    if (begin == end) {
+      return false;
     }
-#undef A
-    return NULL;
+    pthread_mutex_lock(&own.mutex);
+    own.begin = begin;
+    own.end = end;
+    pthread_mutex_unlock(&own.mutex);
+    return true;
+  }
+
+  void runGroups(void* opaque, int worker)
+  {
+    Launch* launch = static_cast<Launch*>(opaque);
+    GroupRunner* runner = launch->context->runners[worker];
+    std::vector<GroupRange>& ranges = launch->ranges;
+    int worker_count = ranges.size();
+    runner->setKernel(launch->kernel);
+
+    bool found = true;
+    while (found) {
+      size_t group_id;
+      while (takeGroup(ranges[worker], group_id)) {
+        runner->run(launch->range, group_id);
+      }
+      // out of work, look for a victim starting from the next worker
+      found = false;
+      for (int i = 1; i < worker_count && !found; ++i) {
+        found = stealGroups(ranges[(worker + i) % worker_count], ranges[worker]);
+      }
+    }
+  }
+}
+
+cl_context_struct::cl_context_struct(const Device& device, cl_device_id id) :
+  device(id),
+  cpus(device.cpus),
+  // Every sub-device is pinned. Device 0 is the whole host, whose CPUs
+  // the application's own threads and other processes use too; the
+  // scheduler moves its workers off busy CPUs, which a pinned worker
+  // would wait for, and pinning places nothing on a NUMA node when the
+  // device spans them all.
+  pinned(id != 0),
+  node(device.node),
+  workers(cpus, pinned)
+{
+  for (int i = 0; i < workers.size(); ++i) {
+    runners.push_back(new GroupRunner);
+  }
+}
+
+cl_context_struct::~cl_context_struct()
+{
+  for (size_t i = 0; i < runners.size(); ++i) {
+    delete runners[i];
   }
+}
+
+extern "C"
+cl_uint get_work_dim()
+{
+  return current_range.work_dim;
+}
+
+extern "C"
+size_t get_global_size(cl_uint dim)
+{
+  return dim < 3 ? current_range.global_size[dim] : 1;
+}
+
+extern "C"
+size_t get_global_id(cl_uint dim)
+{
+  return dim < 3 ? current_item.global_id[dim] : 0;
+}
 
+extern "C"
+size_t get_global_offset(cl_uint dim)
+{
+  return dim < 3 ? current_range.global_offset[dim] : 0;
 }
 
 extern "C"
-size_t get_global_id()
+size_t get_num_groups(cl_uint dim)
 {
-  EnqeueuKernelInfo* info = static_cast<EnqeueuKernelInfo*>(pthread_getspecific(thread_info_key));
-  return info->group_id * info->local_work_size[0] + info->local_id;
+  return dim < 3 ? current_range.num_groups[dim] : 1;
 }
 
 extern "C"
-size_t get_group_id()
+size_t get_group_id(cl_uint dim)
 {
-  EnqeueuKernelInfo* info = static_cast<EnqeueuKernelInfo*>(pthread_getspecific(thread_info_key));
-  return info->group_id;
+  return dim < 3 ? current_item.group_id[dim] : 0;
 }
 
 extern "C"
-size_t get_local_id()
+size_t get_local_id(cl_uint dim)
 {
-  EnqeueuKernelInfo* info = static_cast<EnqeueuKernelInfo*>(pthread_getspecific(thread_info_key));
-  return info->local_id;
+  return dim < 3 ? current_item.local_id[dim] : 0;
 }
 
 extern "C"
-size_t get_local_size(cl_uint x)
+size_t get_local_size(cl_uint dim)
 {
-  EnqeueuKernelInfo* info = static_cast<EnqeueuKernelInfo*>(pthread_getspecific(thread_info_key));
-  return info->local_work_size[x];
+  return dim < 3 ? current_range.local_size[dim] : 1;
 }
 
 namespace {
   size_t optimal_work_size(size_t work_group_size, size_t global_work_size)
   {
-    int size = work_group_size;
+    size_t size = work_group_size;
     while (size > 1 && global_work_size % size != 0) {
       --size;
     }
@@ -355,6 +2414,54 @@ namespace {
   }
 }
 
+namespace {
+  class KernelCommand : public Command {
+  public:
+    KernelCommand(cl_context context, cl_kernel_struct* kernel, const NDRange& range) :
+      context(context),
+      call(kernel),
+      range(range) {
+    }
+
+    virtual void execute() {
+      Launch launch;
+      launch.context = context;
+      launch.kernel = &call;
+      launch.range = range;
+
+      // Groups are numbered x fastest and every worker starts with a
+      // contiguous share of them, so neighbouring tiles of a 2-D or 3-D
+      // range run on the same worker one after another.
+      WorkerPool& workers = context->workers;
+      size_t group_count = range.num_groups[0] * range.num_groups[1] * range.num_groups[2];
+      int worker_count = std::min<size_t>(workers.size(), group_count);
+      launch.ranges.resize(worker_count);
+      for (int i = 0; i < worker_count; ++i) {
+        GroupRange& group_range = launch.ranges[i];
+        pthread_mutex_init(&group_range.mutex, NULL);
+        group_range.begin = group_count * i / worker_count;
+        group_range.end = group_count * (i + 1) / worker_count;
+      }
+      workers.run(runGroups, &launch, worker_count);
+      for (int i = 0; i < worker_count; ++i) {
+        pthread_mutex_destroy(&launch.ranges[i].mutex);
+      }
+
+      std::string profile_path = getEnv("FAKECL_CLAMP_PROFILE");
+      if (call.profiled && !profile_path.empty() &&
+          fakeclWriteClampProfile(profile_path.c_str()) != CL_SUCCESS) {
+        fprintf(stderr, "fakecl: cannot write the check profile to %s\n", profile_path.c_str());
+      }
+      reportClampViolations(call.telemetry);
+    }
+
+  private:
+    cl_context context;
+    KernelCall call;
+    NDRange range;
+  };
+}
+
 cl_int clEnqueueNDRangeKernel(cl_command_queue command_queue,
                               cl_kernel kernel,
                               cl_uint work_dim,
@@ -365,72 +2472,208 @@ cl_int clEnqueueNDRangeKernel(cl_command_queue command_queue,
                               const cl_event *event_wait_list,
                               cl_event *event)
 {
-  size_t temp_local_work_size;
-
-  assert(event_wait_list == NULL);
-  assert(event == NULL);
-  assert(work_dim == 1);
-  assert(global_work_size);
-  assert(global_work_offset == NULL);
-  if (!local_work_size) {
-    local_work_size = &temp_local_work_size;
-    temp_local_work_size = optimal_work_size(work_group_size, *global_work_size);
+  if (work_dim < 1 || work_dim > 3) {
+    return CL_INVALID_WORK_DIMENSION;
+  }
+  if (!global_work_size) {
+    return CL_INVALID_GLOBAL_WORK_SIZE;
+  }
+  if (kernel->param_count >= 0 && kernel->args.size() != (size_t) kernel->param_count) {
+    return CL_INVALID_KERNEL_ARGS;
   }
-  assert(*local_work_size <= work_group_size);
-  assert(num_events_in_wait_list == 0);
-
-  pthread_once(&thread_info_key_once, thread_info_key_init);
-
-  pthread_mutex_lock(&barrier_mutex);
-  barrier_max = *local_work_size;
-  pthread_mutex_unlock(&barrier_mutex);
 
-  pthread_t threads[work_group_size];
-  EnqeueuKernelInfo infos[work_group_size];
+  NDRange range;
+  range.work_dim = work_dim;
+  size_t group_size = 1;
+  for (cl_uint d = 0; d < 3; ++d) {
+    if (d < work_dim) {
+      range.global_offset[d] = global_work_offset ? global_work_offset[d] : 0;
+      range.global_size[d] = global_work_size[d];
+      range.local_size[d] = local_work_size ? local_work_size[d]
+        : optimal_work_size(default_work_group_size / group_size, global_work_size[d]);
+    } else {
+      range.global_offset[d] = 0;
+      range.global_size[d] = 1;
+      range.local_size[d] = 1;
+    }
+    if (range.local_size[d] == 0 || range.global_size[d] % range.local_size[d] != 0) {
+      return CL_INVALID_WORK_GROUP_SIZE;
+    }
+    range.num_groups[d] = range.global_size[d] / range.local_size[d];
+    group_size *= range.local_size[d];
+  }
+  if (group_size > hostInfo().max_work_group_size) {
+    return CL_INVALID_WORK_GROUP_SIZE;
+  }
+  if (localArgsSize(kernel->args) > localArenaSize()) {
+    return CL_OUT_OF_RESOURCES;
+  }
 
   //printf("Local work size: %d\n", *local_work_size);
   //printf("Global work size: %d\n", *global_work_size);
-  for (int group_id = 0;
-       group_id < (*global_work_size + *local_work_size - 1) / *local_work_size * *local_work_size;
-       group_id += *local_work_size) {
-    //printf("Processing starting at group %d %d\n", group_id, *local_work_size);
-    for (int tid = 0; tid < *local_work_size; ++tid) {
-      infos[tid].kernel = kernel;
-      infos[tid].local_work_size = local_work_size;
-      infos[tid].group_id = group_id / *local_work_size;
-      infos[tid].local_id = tid;
-      pthread_create(&threads[tid], NULL, clthread, infos + tid);
+  return enqueue(command_queue, new KernelCommand(command_queue->context, kernel, range),
+                 num_events_in_wait_list, event_wait_list, event, false);
+}
+
+namespace {
+  // gives argument idx a slot of the given size, moving the slots after
+  // it and keeping their values
+  void resizeArgSlot(cl_kernel kernel, size_t idx, size_t size)
+  {
+    std::vector<cl_arg> args = kernel->args;
+    args[idx].size = size;
+    size_t offset = 0;
+    for (size_t i = 0; i < args.size(); ++i) {
+      size_t alignment = argAlignment(args[i].size);
+      offset = (offset + alignment - 1) / alignment * alignment;
+      args[i].offset = offset;
+      offset += args[i].size;
     }
-    for (int tid = 0; tid < *local_work_size; ++tid) {
-      pthread_join(threads[tid], NULL);
+
+    std::vector<char> block(offset);
+    for (size_t i = 0; i < args.size(); ++i) {
+      if (i != idx && args[i].size) {
+        std::memcpy(&block[args[i].offset], &kernel->block[kernel->args[i].offset], args[i].size);
+      }
     }
+    kernel->args.swap(args);
+    kernel->block.swap(block);
   }
-
-  return CL_SUCCESS;
 }
 
-void clSetKernelArg(cl_kernel kernel, int idx, int elem_size, void* data)
+cl_int clSetKernelArg(cl_kernel kernel, int idx, int elem_size, void* data)
 {
-  if (kernel->arg_count < idx + 1) {
-    kernel->arg_count = idx + 1;
-    assert(kernel->arg_count <= FAKECL_MAX_ARGS);
+  // callLegacyKernel passes each argument as one pointer-sized value
+  if (!kernel->entry && data && (size_t) elem_size > sizeof(void*)) {
+    return CL_INVALID_ARG_SIZE;
+  }
+  // a pointer parameter takes a buffer, or NULL; without the thunk's
+  // pointer flags, a pointer-sized value naming a live buffer is taken
+  // for one
+  bool typed = kernel->pointers && idx < kernel->param_count;
+  cl_mem buffer = NULL;
+  if (data && (typed ? kernel->pointers[idx] : elem_size == sizeof(cl_mem))) {
+    if (elem_size != sizeof(cl_mem)) {
+      return CL_INVALID_ARG_SIZE;
+    }
+    cl_mem m = *(cl_mem*) data;
+    pthread_mutex_lock(&live_buffers_mutex);
+    bool live = live_buffers.count(m) > 0;
+    pthread_mutex_unlock(&live_buffers_mutex);
+    if (live) {
+      buffer = m;
+    } else if (typed && m) {
+      return CL_INVALID_MEM_OBJECT;
+    }
+  }
+  if (kernel->args.size() < (size_t) idx + 1) {
+    cl_arg unset = { false, 0, 0, kernel->block.size() };
+    kernel->args.resize(idx + 1, unset);
   }
   cl_arg& arg = kernel->args[idx];
   arg.is_local = data == 0;
+  arg.local_size = arg.is_local ? elem_size : 0;
+  // a __local argument is a pointer to memory the worker allocates
+  size_t size = arg.is_local ? sizeof(void*) : elem_size;
+  if (arg.size != size) {
+    resizeArgSlot(kernel, idx, size);
+  }
+
+  char* slot = &kernel->block[kernel->args[idx].offset];
   if (data) {
-    arg.data = std::vector<char>((char*) data, (char*) data + elem_size);
-  } else {
-    arg.data.resize(elem_size);
+    if (buffer) {
+      std::memcpy(slot, &buffer->ptr, sizeof(void*));
+    } else {
+      std::memcpy(slot, data, elem_size);
+    }
   }
+  return CL_SUCCESS;
 }
 
-cl_int clFinish(cl_command_queue)
+cl_int clFinish(cl_command_queue command_queue)
 {
+  pthread_mutex_lock(&command_queue->mutex);
+  while (!command_queue->commands.empty()) {
+    pthread_cond_wait(&command_queue->cond, &command_queue->mutex);
+  }
+  pthread_mutex_unlock(&command_queue->mutex);
   return CL_SUCCESS;
 }
 
 cl_int clFlush(cl_command_queue)
 {
+  // commands are submitted to the queue's thread as they are enqueued
+  return CL_SUCCESS;
+}
+
+cl_int clEnqueueMarker(cl_command_queue command_queue,
+                       cl_event *event)
+{
+  return enqueue(command_queue, new MarkerCommand, 0, NULL, event, false);
+}
+
+cl_int clEnqueueWaitForEvents(cl_command_queue command_queue,
+                              cl_uint num_events,
+                              const cl_event *event_list)
+{
+  return enqueue(command_queue, new MarkerCommand, num_events, event_list, NULL, false);
+}
+
+cl_int clWaitForEvents(cl_uint num_events,
+                       const cl_event *event_list)
+{
+  for (cl_uint i = 0; i < num_events; ++i) {
+    waitEvent(event_list[i]);
+  }
+  return CL_SUCCESS;
+}
+
+cl_int clGetEventInfo(cl_event event,
+                      cl_event_info param_name,
+                      size_t param_value_size,
+                      void *param_value,
+                      size_t *param_value_size_ret)
+{
+  pthread_mutex_lock(&event->mutex);
+  cl_int status = event->status;
+  cl_uint refcount = event->refcount;
+  pthread_mutex_unlock(&event->mutex);
+  switch (param_name) {
+  case CL_EVENT_COMMAND_EXECUTION_STATUS: R(cl_int, status);
+  case CL_EVENT_REFERENCE_COUNT: R(cl_uint, refcount);
+  }
+  assert(false);
+  return CL_SUCCESS;
+}
+
+cl_int clGetEventProfilingInfo(cl_event event,
+                               cl_profiling_info param_name,
+                               size_t param_value_size,
+                               void *param_value,
+                               size_t *param_value_size_ret)
+{
+  if (param_name < CL_PROFILING_COMMAND_QUEUED || param_name > CL_PROFILING_COMMAND_END) {
+    return CL_INVALID_VALUE;
+  }
+  pthread_mutex_lock(&event->mutex);
+  bool available = event->profiling && event->status == CL_COMPLETE;
+  cl_ulong time = available ? event->times[param_name - CL_PROFILING_COMMAND_QUEUED] : 0;
+  pthread_mutex_unlock(&event->mutex);
+  if (!available) {
+    return CL_PROFILING_INFO_NOT_AVAILABLE;
+  }
+  R(cl_ulong, time);
+}
+
+cl_int clRetainEvent(cl_event event)
+{
+  retainEvent(event);
+  return CL_SUCCESS;
+}
+
+cl_int clReleaseEvent(cl_event event)
+{
+  releaseEvent(event);
   return CL_SUCCESS;
 }
 
@@ -450,25 +2693,121 @@ cl_int clGetDeviceIDs(cl_platform_id platform,
 }
 
 
+cl_int clCreateSubDevices(cl_device_id in_device,
+                          const cl_device_partition_property *properties,
+                          cl_uint num_devices,
+                          cl_device_id *out_devices,
+                          cl_uint *num_devices_ret)
+{
+  Device parent;
+  if (!getDevice(in_device, parent)) {
+    return CL_INVALID_DEVICE;
+  }
+  if (!properties) {
+    return CL_INVALID_VALUE;
+  }
+
+  // the parent's CPUs are ordered by node, so consecutive shares of
+  // them stay within a node where they can
+  const std::vector<int>& cpus = parent.cpus;
+  std::vector<std::vector<int> > partitions;
+  switch (properties[0]) {
+  case CL_DEVICE_PARTITION_EQUALLY: {
+    size_t count = properties[1];
+    if (count == 0) {
+      return CL_INVALID_DEVICE_PARTITION_COUNT;
+    }
+    if (count > cpus.size()) {
+      return CL_DEVICE_PARTITION_FAILED;
+    }
+    for (size_t first = 0; first + count <= cpus.size(); first += count) {
+      partitions.push_back(std::vector<int>(cpus.begin() + first, cpus.begin() + first + count));
+    }
+    break;
+  }
+  case CL_DEVICE_PARTITION_BY_COUNTS: {
+    size_t first = 0;
+    for (const cl_device_partition_property* count = properties + 1;
+         *count != CL_DEVICE_PARTITION_BY_COUNTS_LIST_END;
+         ++count) {
+      if (*count < 0 || first + *count > cpus.size()) {
+        return CL_INVALID_DEVICE_PARTITION_COUNT;
+      }
+      partitions.push_back(std::vector<int>(cpus.begin() + first, cpus.begin() + first + *count));
+      first += *count;
+    }
+    break;
+  }
+  case CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN:
+    if (properties[1] != CL_DEVICE_AFFINITY_DOMAIN_NUMA &&
+        properties[1] != CL_DEVICE_AFFINITY_DOMAIN_NEXT_PARTITIONABLE) {
+      return CL_INVALID_VALUE;
+    }
+    for (size_t i = 0; i < cpus.size(); ++i) {
+      if (i == 0 || nodeOf(cpus[i]) != nodeOf(cpus[i - 1])) {
+        partitions.push_back(std::vector<int>());
+      }
+      partitions.back().push_back(cpus[i]);
+    }
+    break;
+  default:
+    return CL_INVALID_VALUE;
+  }
+
+  if (partitions.empty()) {
+    return CL_DEVICE_PARTITION_FAILED;
+  }
+  if (out_devices && num_devices < partitions.size()) {
+    return CL_INVALID_VALUE;
+  }
+  if (num_devices_ret) {
+    *num_devices_ret = partitions.size();
+  }
+  if (out_devices) {
+    pthread_mutex_lock(&devices_mutex);
+    for (size_t i = 0; i < partitions.size(); ++i) {
+      out_devices[i] = devices.size();
+      devices.push_back(makeDevice(partitions[i], in_device));
+    }
+    pthread_mutex_unlock(&devices_mutex);
+  }
+  return CL_SUCCESS;
+}
+
+cl_int clRetainDevice(cl_device_id device)
+{
+  return CL_SUCCESS;
+}
+
+cl_int clReleaseDevice(cl_device_id device)
+{
+  return CL_SUCCESS;
+}
+
 cl_int clGetDeviceInfo(cl_device_id device,
                        cl_device_info param_name,
                        size_t param_value_size,
                        void *param_value,
                        size_t *param_value_size_ret)
 {
+  const HostInfo& host = hostInfo();
+  Device info;
+  if (!getDevice(device, info)) {
+    return CL_INVALID_DEVICE;
+  }
   switch (param_name) {
   case CL_DEVICE_ADDRESS_BITS                  : R(cl_uint, 64);
   case CL_DEVICE_AVAILABLE                     : R(cl_bool, true);
   case CL_DEVICE_COMPILER_AVAILABLE            : R(cl_bool, true); // a lie
   case CL_DEVICE_DOUBLE_FP_CONFIG              : assert(false);
-  case CL_DEVICE_ENDIAN_LITTLE                 : assert(false);
+  case CL_DEVICE_ENDIAN_LITTLE                 : R(cl_bool, true);
   case CL_DEVICE_ERROR_CORRECTION_SUPPORT      : assert(false);
   case CL_DEVICE_EXECUTION_CAPABILITIES        : assert(false);
   case CL_DEVICE_EXTENSIONS                    : assert(false);
-  case CL_DEVICE_GLOBAL_MEM_CACHE_SIZE         : assert(false);
-  case CL_DEVICE_GLOBAL_MEM_CACHE_TYPE         : assert(false);
-  case CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE     : assert(false);
-  case CL_DEVICE_GLOBAL_MEM_SIZE               : R(cl_uint, 2<<20);
+  case CL_DEVICE_GLOBAL_MEM_CACHE_SIZE         : R(cl_ulong, host.cache_size);
+  case CL_DEVICE_GLOBAL_MEM_CACHE_TYPE         : R(cl_device_mem_cache_type, CL_READ_WRITE_CACHE);
+  case CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE     : R(cl_uint, host.cacheline_size);
+  case CL_DEVICE_GLOBAL_MEM_SIZE               : R(cl_ulong, host.memory_size);
   case CL_DEVICE_HALF_FP_CONFIG                : assert(false);
   case CL_DEVICE_IMAGE_SUPPORT                 : assert(false);
   case CL_DEVICE_IMAGE2D_MAX_HEIGHT            : assert(false);
@@ -476,39 +2815,46 @@ cl_int clGetDeviceInfo(cl_device_id device,
   case CL_DEVICE_IMAGE3D_MAX_DEPTH             : assert(false);
   case CL_DEVICE_IMAGE3D_MAX_HEIGHT            : assert(false);
   case CL_DEVICE_IMAGE3D_MAX_WIDTH             : assert(false);
-  case CL_DEVICE_LOCAL_MEM_SIZE                : R(cl_uint, 2<<20);
-  case CL_DEVICE_LOCAL_MEM_TYPE                : assert(false);
-  case CL_DEVICE_MAX_CLOCK_FREQUENCY           : R(cl_uint, 1);
-  case CL_DEVICE_MAX_COMPUTE_UNITS             : R(cl_uint, work_group_size);
+  case CL_DEVICE_LOCAL_MEM_SIZE                : R(cl_ulong, localArenaSize());
+  case CL_DEVICE_LOCAL_MEM_TYPE                : R(cl_device_local_mem_type, CL_GLOBAL);
+  case CL_DEVICE_MAX_CLOCK_FREQUENCY           : R(cl_uint, host.clock_mhz);
+  case CL_DEVICE_MAX_COMPUTE_UNITS             : R(cl_uint, info.cpus.size());
   case CL_DEVICE_MAX_CONSTANT_ARGS             : assert(false);
   case CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE      : assert(false);
-  case CL_DEVICE_MAX_MEM_ALLOC_SIZE            : assert(false);
+  case CL_DEVICE_MAX_MEM_ALLOC_SIZE            : R(cl_ulong, host.memory_size / 4);
   case CL_DEVICE_MAX_PARAMETER_SIZE            : assert(false);
   case CL_DEVICE_MAX_READ_IMAGE_ARGS           : assert(false);
   case CL_DEVICE_MAX_SAMPLERS                  : assert(false);
-  case CL_DEVICE_MAX_WORK_GROUP_SIZE           : assert(false);
-  case CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS      : assert(false);
-  case CL_DEVICE_MAX_WORK_ITEM_SIZES           : assert(false);
+  case CL_DEVICE_MAX_WORK_GROUP_SIZE           : R(size_t, host.max_work_group_size);
+  case CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS      : R(cl_uint, 3);
+  case CL_DEVICE_MAX_WORK_ITEM_SIZES           : {
+    size_t sizes[3] = { host.max_work_group_size, host.max_work_group_size, host.max_work_group_size };
+    if (param_value_size_ret) *param_value_size_ret = sizeof(sizes);
+    if (sizeof(sizes) <= param_value_size) std::memcpy(param_value, sizes, sizeof(sizes));
+    return CL_SUCCESS;
+  }
   case CL_DEVICE_MAX_WRITE_IMAGE_ARGS          : assert(false);
   case CL_DEVICE_MEM_BASE_ADDR_ALIGN           : assert(false);
   case CL_DEVICE_MIN_DATA_TYPE_ALIGN_SIZE      : assert(false);
   case CL_DEVICE_NAME                          : RS("FakeCL");
   case CL_DEVICE_PLATFORM                      : assert(false);
-  case CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR   : assert(false);
-  case CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT  : assert(false);
-  case CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT    : assert(false);
-  case CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG   : assert(false);
-  case CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT  : assert(false);
-  case CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE : assert(false);
+  case CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR   : R(cl_uint, host.vector_bytes / sizeof(cl_char));
+  case CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT  : R(cl_uint, host.vector_bytes / sizeof(short));
+  case CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT    : R(cl_uint, host.vector_bytes / sizeof(cl_int));
+  case CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG   : R(cl_uint, host.vector_bytes / sizeof(cl_long));
+  case CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT  : R(cl_uint, host.vector_bytes / sizeof(float));
+  case CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE : R(cl_uint, host.vector_bytes / sizeof(double));
   case CL_DEVICE_PROFILE                       : assert(false);
   case CL_DEVICE_PROFILING_TIMER_RESOLUTION    : assert(false);
   case CL_DEVICE_QUEUE_PROPERTIES              : assert(false);
   case CL_DEVICE_SINGLE_FP_CONFIG              : assert(false);
-  case CL_DEVICE_TYPE                          : assert(false);
+  case CL_DEVICE_TYPE                          : R(cl_device_type, CL_DEVICE_TYPE_CPU);
   case CL_DEVICE_VENDOR                        : RS("NRC");
   case CL_DEVICE_VENDOR_ID                     : assert(false);
   case CL_DEVICE_VERSION                       : RS("1.1");
   case CL_DRIVER_VERSION                       : RS("0.1");
+  case CL_DEVICE_PARENT_DEVICE                 : R(cl_device_id, info.parent);
+  case CL_DEVICE_PARTITION_MAX_SUB_DEVICES     : R(cl_uint, info.cpus.size());
   } 
   return CL_SUCCESS;
 }
@@ -521,7 +2867,7 @@ cl_int clGetKernelWorkGroupInfo(cl_kernel kernel,
                                 size_t *param_value_size_ret)
 {
   switch (param_name) {
-  case CL_KERNEL_WORK_GROUP_SIZE: R(size_t, work_group_size);
+  case CL_KERNEL_WORK_GROUP_SIZE: R(size_t, hostInfo().max_work_group_size);
   case CL_KERNEL_COMPILE_WORK_GROUP_SIZE: assert(false);
   case CL_KERNEL_LOCAL_MEM_SIZE: R(cl_ulong, ~0ull);
   }
@@ -559,11 +2905,21 @@ cl_int clGetPlatformInfo(cl_platform_id platform,
 
 cl_int clReleaseCommandQueue(cl_command_queue command_queue)
 {
+  // the thread finishes the remaining commands before it quits
+  pthread_mutex_lock(&command_queue->mutex);
+  command_queue->quit = true;
+  pthread_cond_broadcast(&command_queue->cond);
+  pthread_mutex_unlock(&command_queue->mutex);
+  pthread_join(command_queue->thread, NULL);
+  pthread_cond_destroy(&command_queue->cond);
+  pthread_mutex_destroy(&command_queue->mutex);
+  delete command_queue;
   return CL_SUCCESS;
 }
 
 cl_int clReleaseContext(cl_context context)
 {
+  delete context;
   return CL_SUCCESS;
 }
 
@@ -575,26 +2931,14 @@ cl_int clReleaseKernel(cl_kernel kernel)
 
 cl_int clReleaseProgram(cl_program program)
 {
+  // the library stays loaded, kernels created from it may still run
+  delete program;
   return CL_SUCCESS;
 }
 
 extern "C" void barrier(int)
 {
-  pthread_mutex_lock(&barrier_mutex);
-  int start_seq = barrier_completed_seq;
-  ++barrier_enter;
-  if (barrier_enter != barrier_max) {
-    while (barrier_completed_seq == start_seq) {
-      pthread_cond_wait(&barrier_cond, &barrier_mutex);
-    }
-  } else {
-    // if we are the last one to enter, notify everyone
-    //printf("---\n"); fflush(stdout);
-    ++barrier_completed_seq;
-    barrier_enter = 0;
-    pthread_cond_broadcast(&barrier_cond);
-  }
-  pthread_mutex_unlock(&barrier_mutex);
+  current_runner->yield(current_item.local_index);
 }
 
 } // extern "C"
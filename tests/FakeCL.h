@@ -11,18 +11,48 @@
 #define FAKECL_HPP
 
 #include <stdlib.h>             /* for size_t */
+#include <stdint.h>             /* for intptr_t */
 
 #ifdef __cplusplus
 #define FAKECL_EXTERN extern "C"
 #endif
 
 #define CL_SUCCESS                               0
+#define CL_MEM_OBJECT_ALLOCATION_FAILURE         -4
+#define CL_OUT_OF_RESOURCES                      -5
+#define CL_PROFILING_INFO_NOT_AVAILABLE          -7
+#define CL_MEM_COPY_OVERLAP                      -8
+#define CL_DEVICE_PARTITION_FAILED               -18
+#define CL_INVALID_DEVICE_PARTITION_COUNT        -19
+#define CL_BUILD_PROGRAM_FAILURE                 -11
+#define CL_INVALID_VALUE                         -30
+#define CL_INVALID_DEVICE                        -33
+#define CL_INVALID_CONTEXT                       -34
+#define CL_INVALID_HOST_PTR                      -37
+#define CL_INVALID_MEM_OBJECT                    -38
+#define CL_INVALID_BINARY                        -42
+#define CL_INVALID_KERNEL_NAME                   -46
+#define CL_INVALID_ARG_SIZE                      -51
+#define CL_INVALID_KERNEL_ARGS                   -52
+#define CL_INVALID_WORK_DIMENSION                -53
+#define CL_INVALID_WORK_GROUP_SIZE               -54
+#define CL_INVALID_GLOBAL_WORK_SIZE              -63
 
 #define CL_PROGRAM_BUILD_LOG                     1
 
+#define CL_PROGRAM_NUM_DEVICES                   0
+#define CL_PROGRAM_BINARY_SIZES                  1
+#define CL_PROGRAM_BINARIES                      2
+
 #define CL_MEM_READ_ONLY                         1
 #define CL_MEM_USE_HOST_PTR                      2
 #define CL_MEM_READ_WRITE                        4
+#define CL_MEM_WRITE_ONLY                        8
+#define CL_MEM_ALLOC_HOST_PTR                    16
+#define CL_MEM_COPY_HOST_PTR                     32
+
+#define CL_MAP_READ                              1
+#define CL_MAP_WRITE                             2
 
 #define CL_DEVICE_ADDRESS_BITS                   0
 #define CL_DEVICE_AVAILABLE                      1
@@ -76,6 +106,20 @@
 #define CL_DEVICE_VENDOR_ID                      49
 #define CL_DEVICE_VERSION                        50
 #define CL_DRIVER_VERSION                        51
+#define CL_DEVICE_PARENT_DEVICE                  52
+#define CL_DEVICE_PARTITION_MAX_SUB_DEVICES      53
+
+#define CL_DEVICE_PARTITION_EQUALLY              0x1086
+#define CL_DEVICE_PARTITION_BY_COUNTS            0x1087
+#define CL_DEVICE_PARTITION_BY_COUNTS_LIST_END   0x0
+#define CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN   0x1088
+
+#define CL_DEVICE_AFFINITY_DOMAIN_NUMA           (1 << 0)
+#define CL_DEVICE_AFFINITY_DOMAIN_L4_CACHE       (1 << 1)
+#define CL_DEVICE_AFFINITY_DOMAIN_L3_CACHE       (1 << 2)
+#define CL_DEVICE_AFFINITY_DOMAIN_L2_CACHE       (1 << 3)
+#define CL_DEVICE_AFFINITY_DOMAIN_L1_CACHE       (1 << 4)
+#define CL_DEVICE_AFFINITY_DOMAIN_NEXT_PARTITIONABLE (1 << 5)
 
 #define CL_FP_DENORM                             0 //denorms are supported.
 #define CL_FP_INF_NAN                            1 // INF and NaNs are suppor
@@ -84,6 +128,13 @@
 #define CL_FP_ROUND_TO_INF                       4 // round to +ve and -
 #define CP_FP_FMA                                5 // IEEE754-2008 fused multiply-
 
+#define CL_NONE                                  0
+#define CL_READ_ONLY_CACHE                       1
+#define CL_READ_WRITE_CACHE                      2
+
+#define CL_LOCAL                                 1
+#define CL_GLOBAL                                2
+
 #define CL_KERNEL_WORK_GROUP_SIZE                0
 #define CL_KERNEL_COMPILE_WORK_GROUP_SIZE        1
 #define CL_KERNEL_LOCAL_MEM_SIZE                 2
@@ -102,11 +153,28 @@
 #define CL_CONTEXT_PROPERTIES                    2
 #define CL_CONTEXT_PLATFORM                      3
 
-#define CL_TRUE                                  ((cl_bool) false)
-#define CL_FALSE                                 ((cl_bool) true)
+#define CL_EVENT_COMMAND_EXECUTION_STATUS        0
+#define CL_EVENT_REFERENCE_COUNT                 1
+
+#define CL_COMPLETE                              0
+#define CL_RUNNING                               1
+#define CL_SUBMITTED                             2
+#define CL_QUEUED                                3
 
-/* maximum number of supported arguments; if you adjust this, fix
-   clEnqueueNDRangeKernel and related functions as well */
+#define CL_QUEUE_PROFILING_ENABLE                2
+
+/* in the order of the status changes; see setEventStatus */
+#define CL_PROFILING_COMMAND_QUEUED              0
+#define CL_PROFILING_COMMAND_SUBMIT              1
+#define CL_PROFILING_COMMAND_START               2
+#define CL_PROFILING_COMMAND_END                 3
+
+#define CL_TRUE                                  ((cl_bool) true)
+#define CL_FALSE                                 ((cl_bool) false)
+
+/* maximum number of arguments of a kernel registered with
+   fakeclSetKernelFunc; if you adjust this, fix callLegacyKernel as
+   well. Kernels with an entry have no limit. */
 #define FAKECL_MAX_ARGS                          20
 
 typedef int                      cl_int;
@@ -118,30 +186,82 @@ typedef char                     cl_char;
 
 /* most of these types are just placeholders, replaced with actual
    structs if they are truly implemented */
-typedef int                      cl_context;
-typedef int                      cl_command_queue;
+typedef struct cl_context_struct* cl_context;
+typedef struct cl_command_queue_struct* cl_command_queue;
 typedef int                      cl_device_id;
 typedef int                      cl_platform_id;
 typedef int                      cl_device_type;
-typedef void*                    cl_mem;
+typedef struct cl_mem_struct*    cl_mem;
 typedef int                      cl_device_info;
+typedef intptr_t                 cl_device_partition_property;
+typedef int                      cl_device_mem_cache_type;
+typedef int                      cl_device_local_mem_type;
 typedef int                      cl_platform_info;
 typedef int                      cl_kernel_work_group_info;
 typedef int                      cl_program_build_info;
 typedef int                      cl_mem_flags;
+typedef int                      cl_map_flags;
 typedef struct cl_kernel_struct* cl_kernel;
-typedef int                      cl_program;
-typedef int                      cl_event;
-typedef int                      cl_command_queue;
+typedef struct cl_program_struct* cl_program;
+typedef int                      cl_program_info;
+typedef struct cl_event_struct* cl_event;
+typedef int                      cl_event_info;
+typedef int                      cl_profiling_info;
 typedef int                      cl_context_properties;
 typedef int                      cl_context_info;
 typedef                          void (*fakecl_kernel_fn)(...);
 
+/* Takes a kernel's arguments packed into one block: each argument in
+   order at the next offset aligned to the smallest power of two not
+   less than its size, at most 16. Buffers and __local arguments are
+   pointers. The block itself is 64-byte aligned. The clamp-pointers
+   plugin's -fakecl-entry-thunks pass generates these as
+   __fakecl_entry_<kernel>, with the kernel's parameter count as the
+   int __fakecl_params_<kernel> and a char __fakecl_pointers_<kernel>[]
+   that is 1 for each pointer parameter. */
+typedef                          void (*fakecl_kernel_entry)(const void* args);
+
 extern "C" {
 // sets an assocation from a string to a CL function
 void fakeclSetKernelFunc(const char* label, fakecl_kernel_fn);
 
-/* noop */
+/* associates a string with an entry taking the packed argument block */
+void fakeclSetKernelEntry(const char* label, fakecl_kernel_entry);
+
+/* writes the boundary check counts of the programs built with the
+   plugin's -clamp-pointers-profile, one check per line as
+   "<id> <executions> <failures> <load|store> <function> <file>:<line>:<column>",
+   for -clamp-pointers-profile-use. With FAKECL_CLAMP_PROFILE set in the
+   environment, the profile is written there after each launch of such
+   a program's kernels. */
+cl_int fakeclWriteClampProfile(const char* path);
+
+/* a boundary check failure recorded by a program built with the
+   plugin's -clamp-pointers-telemetry */
+typedef struct {
+  int check;                         /* id, as in the check profile */
+  unsigned long long work_item[3];   /* global id */
+  unsigned long long address;        /* of the failed access */
+  unsigned long long first;          /* first and last valid address */
+  unsigned long long last;           /* for the access */
+} fakecl_clamp_violation;
+
+typedef void (*fakecl_violation_handler)(const fakecl_clamp_violation* violations,
+                                         size_t count,
+                                         unsigned long long dropped,
+                                         void* user_data);
+
+/* sets the function given the failures recorded during each launch of a
+   kernel built with -clamp-pointers-telemetry, and the number of those
+   that did not fit in the program's buffer. The buffer is emptied after
+   each launch. A NULL handler, the default, prints the failures to
+   stderr. */
+void fakeclSetClampViolationHandler(fakecl_violation_handler handler, void* user_data);
+
+/* creates a context owning the worker threads kernels run on, one for
+   each CPU of its devices. On sub-devices the threads are pinned to
+   those CPUs and new buffers are first touched there, so that they are
+   allocated on the device's NUMA node. */
 cl_context clCreateContext(cl_context_properties *properties,
                            cl_uint num_devices,
                            const cl_device_id *devices,
@@ -154,7 +274,7 @@ cl_context clCreateContext(cl_context_properties *properties,
                            void *user_data,
                            cl_int *errcode_ret);
 
-/* noop */
+/* like clCreateContext on the whole host */
 cl_context clCreateContextFromType(cl_context_properties   *properties,
                                    cl_device_type  device_type,
                                    void  (*pfn_notify) (const char *errinfo,
@@ -170,7 +290,10 @@ cl_int clGetContextInfo(cl_context context,
                         void *param_value,
                         size_t* param_value_size_ret);
 
-/* creates a buffer. data is not copied. */
+/* creates a buffer. With CL_MEM_USE_HOST_PTR the buffer is the host
+   memory itself, with CL_MEM_COPY_HOST_PTR it starts as a copy of it.
+   Other buffers come from a pool of cache line aligned allocations
+   that reuses the memory of released buffers. */
 cl_mem clCreateBuffer(cl_context context,
                       cl_mem_flags flags,
                       size_t size,
@@ -180,22 +303,44 @@ cl_mem clCreateBuffer(cl_context context,
 /* releases the object */
 cl_int clReleaseMemObject(cl_mem memobj);
 
-/* noop */
-cl_command_queue clCreateCommandQueue(cl_context, cl_device_id, int, int* ret);
+/* creates an in-order queue with a thread of its own that runs the
+   commands; kernels run on the context's workers. The only property
+   is CL_QUEUE_PROFILING_ENABLE. */
+cl_command_queue clCreateCommandQueue(cl_context, cl_device_id, int properties, int* ret);
 
-/* finds the kernel associated with the name previously with fakeclSetKernelFunc */
+/* finds the kernel of the name in the built program if it was compiled,
+   otherwise the one associated by fakeclSetKernelEntry, an exported
+   __fakecl_entry_<name> or fakeclSetKernelFunc, in that order */
 cl_kernel clCreateKernel(cl_program  program,
                          const char *kernel_name,
                          cl_int *errcode_ret);
 
-/* does nothing but succeeds */
+/* keeps the source for clBuildProgram */
 cl_program clCreateProgramWithSource(cl_context context,
                                      cl_uint count,
                                      const char **strings,
                                      const size_t *lengths,
                                      cl_int *errcode_ret);
 
-/* executes the copy synchronously */
+/* keeps the LLVM IR, as returned in CL_PROGRAM_BINARIES, for
+   clBuildProgram; only one device is supported */
+cl_program clCreateProgramWithBinary(cl_context context,
+                                     cl_uint num_devices,
+                                     const cl_device_id *device_list,
+                                     const size_t *lengths,
+                                     const unsigned char **binaries,
+                                     cl_int *binary_status,
+                                     cl_int *errcode_ret);
+
+/* the binary is the optimized LLVM IR of a compiled program, empty
+   otherwise */
+cl_int clGetProgramInfo(cl_program program,
+                        cl_program_info param_name,
+                        size_t param_value_size,
+                        void *param_value,
+                        size_t *param_value_size_ret);
+
+/* enqueues the copy; waits for it if blocking_write */
 cl_int clEnqueueWriteBuffer(cl_command_queue command_queue,
                             cl_mem buffer,
                             cl_bool blocking_write,
@@ -206,7 +351,7 @@ cl_int clEnqueueWriteBuffer(cl_command_queue command_queue,
                             const cl_event *event_wait_list,
                             cl_event *event);
 
-/* executes the copy synchronously */
+/* enqueues the copy; waits for it if blocking_read */
 cl_int clEnqueueReadBuffer(cl_command_queue command_queue,
                            cl_mem buffer,
                            cl_bool blocking_read,
@@ -217,7 +362,87 @@ cl_int clEnqueueReadBuffer(cl_command_queue command_queue,
                            const cl_event *event_wait_list,
                            cl_event *event);
 
-/* noop */
+/* enqueues the copy; buffers may be the same if the ranges do not
+   overlap. Large transfers, this and the ones below, are split over the
+   context's workers and use non-temporal stores when bigger than the
+   cache. */
+cl_int clEnqueueCopyBuffer(cl_command_queue command_queue,
+                           cl_mem src_buffer,
+                           cl_mem dst_buffer,
+                           size_t src_offset,
+                           size_t dst_offset,
+                           size_t cb,
+                           cl_uint num_events_in_wait_list,
+                           const cl_event *event_wait_list,
+                           cl_event *event);
+
+/* enqueues filling with a pattern of 1, 2, 4, ... or 128 bytes */
+cl_int clEnqueueFillBuffer(cl_command_queue command_queue,
+                           cl_mem buffer,
+                           const void *pattern,
+                           size_t pattern_size,
+                           size_t offset,
+                           size_t cb,
+                           cl_uint num_events_in_wait_list,
+                           const cl_event *event_wait_list,
+                           cl_event *event);
+
+/* enqueues the copy of a 2-D or 3-D region; zero pitches mean tightly
+   packed rows and slices. Fails with CL_INVALID_VALUE for an empty
+   region, pitches that make rows or slices overlap or a region past the
+   end of the buffer. */
+cl_int clEnqueueWriteBufferRect(cl_command_queue command_queue,
+                                cl_mem buffer,
+                                cl_bool blocking_write,
+                                const size_t *buffer_origin,
+                                const size_t *host_origin,
+                                const size_t *region,
+                                size_t buffer_row_pitch,
+                                size_t buffer_slice_pitch,
+                                size_t host_row_pitch,
+                                size_t host_slice_pitch,
+                                const void *ptr,
+                                cl_uint num_events_in_wait_list,
+                                const cl_event *event_wait_list,
+                                cl_event *event);
+
+/* like clEnqueueWriteBufferRect */
+cl_int clEnqueueReadBufferRect(cl_command_queue command_queue,
+                               cl_mem buffer,
+                               cl_bool blocking_read,
+                               const size_t *buffer_origin,
+                               const size_t *host_origin,
+                               const size_t *region,
+                               size_t buffer_row_pitch,
+                               size_t buffer_slice_pitch,
+                               size_t host_row_pitch,
+                               size_t host_slice_pitch,
+                               void *ptr,
+                               cl_uint num_events_in_wait_list,
+                               const cl_event *event_wait_list,
+                               cl_event *event);
+
+/* returns a pointer into the buffer itself; nothing is copied */
+void* clEnqueueMapBuffer(cl_command_queue command_queue,
+                         cl_mem buffer,
+                         cl_bool blocking_map,
+                         cl_map_flags map_flags,
+                         size_t offset,
+                         size_t cb,
+                         cl_uint num_events_in_wait_list,
+                         const cl_event *event_wait_list,
+                         cl_event *event,
+                         cl_int *errcode_ret);
+
+/* noop apart from ordering, a mapping is the buffer itself */
+cl_int clEnqueueUnmapMemObject(cl_command_queue command_queue,
+                               cl_mem memobj,
+                               void *mapped_ptr,
+                               cl_uint num_events_in_wait_list,
+                               const cl_event *event_wait_list,
+                               cl_event *event);
+
+/* returns the output of the compilation steps and the build time */
 cl_int clGetProgramBuildInfo(cl_program  program,
                              cl_device_id  device,
                              cl_program_build_info  param_name,
@@ -225,8 +450,21 @@ cl_int clGetProgramBuildInfo(cl_program  program,
                              void  *param_value,
                              size_t  *param_value_size_ret);
 
-/* executes the kernel synchronously. The threads for a single
-   workgroup are executed in parallel, respecting barriers. */
+/* enqueues the kernel with its current arguments. It runs over a 1, 2
+   or 3 dimensional range, optionally offset, and fails with
+   CL_INVALID_WORK_DIMENSION for any other work_dim, with
+   CL_INVALID_GLOBAL_WORK_SIZE without a global size, with
+   CL_INVALID_KERNEL_ARGS when a kernel with a known parameter count has
+   a different number of arguments set, or with CL_INVALID_WORK_GROUP_SIZE when the
+   local size doesn't divide the global size or has more work-items
+   than CL_DEVICE_MAX_WORK_GROUP_SIZE, or with CL_OUT_OF_RESOURCES
+   when its __local arguments don't fit in CL_DEVICE_LOCAL_MEM_SIZE.
+   The work-items of a single
+   workgroup run as fibers on one worker thread, switching at barriers,
+   or as a plain loop when the kernel never reaches a barrier, which the
+   kernel's entry thunk tells or the first workgroup run finds out;
+   workgroups are spread over the workers, which steal groups from
+   each other when they run out. */
 cl_int clEnqueueNDRangeKernel(cl_command_queue command_queue,
                               cl_kernel kernel,
                               cl_uint work_dim,
@@ -237,15 +475,54 @@ cl_int clEnqueueNDRangeKernel(cl_command_queue command_queue,
                               const cl_event *event_wait_list,
                               cl_event *event);
 
-/* set kernel argument, copies argument contents */
-void clSetKernelArg(cl_kernel kernel, int idx, int elem_size, void* data);
+/* set kernel argument, copies argument contents. Buffers are resolved
+   to their data here, once. Whether an argument is a buffer follows the
+   parameter's type in __fakecl_pointers_<kernel>, failing with
+   CL_INVALID_MEM_OBJECT for a pointer parameter set with something else;
+   kernels without it take any pointer-sized value naming a live buffer
+   for one. Fails with CL_INVALID_ARG_SIZE for a value larger than a
+   pointer when the kernel has no entry thunk. */
+cl_int clSetKernelArg(cl_kernel kernel, int idx, int elem_size, void* data);
 
-/* noop */
+/* waits until every command enqueued so far has finished */
 cl_int clFinish(cl_command_queue command_queue);
 
-/* noop */
+/* noop, commands are submitted as they are enqueued */
 cl_int clFlush(cl_command_queue command_queue);
 
+/* enqueues a command that completes when the ones before it have */
+cl_int clEnqueueMarker(cl_command_queue command_queue,
+                       cl_event *event);
+
+/* makes the commands enqueued after this wait for the events */
+cl_int clEnqueueWaitForEvents(cl_command_queue command_queue,
+                              cl_uint num_events,
+                              const cl_event *event_list);
+
+/* waits until the commands of all the events have finished */
+cl_int clWaitForEvents(cl_uint num_events,
+                       const cl_event *event_list);
+
+/* works for the execution status and the reference count */
+cl_int clGetEventInfo(cl_event event,
+                      cl_event_info param_name,
+                      size_t param_value_size,
+                      void *param_value,
+                      size_t *param_value_size_ret);
+
+/* returns the time in nanoseconds at which the command of the event was
+   queued, submitted, started or ended, if its queue has profiling
+   enabled and the command has finished */
+cl_int clGetEventProfilingInfo(cl_event event,
+                               cl_profiling_info param_name,
+                               size_t param_value_size,
+                               void *param_value,
+                               size_t *param_value_size_ret);
+
+cl_int clRetainEvent(cl_event event);
+
+cl_int clReleaseEvent(cl_event event);
+
 /* returns one device */
 cl_int clGetDeviceIDs(cl_platform_id platform,
                       cl_device_type device_type,
@@ -253,7 +530,24 @@ cl_int clGetDeviceIDs(cl_platform_id platform,
                       cl_device_id *devices,
                       cl_uint *num_devices);
 
-/* works for some parameters. asserts(false) on unsupported  */
+/* partitions a device's CPUs equally, by counts or by NUMA node
+   (CL_DEVICE_AFFINITY_DOMAIN_NUMA or _NEXT_PARTITIONABLE); other
+   affinity domains are not supported. Sub-devices live until exit. */
+cl_int clCreateSubDevices(cl_device_id in_device,
+                          const cl_device_partition_property *properties,
+                          cl_uint num_devices,
+                          cl_device_id *out_devices,
+                          cl_uint *num_devices_ret);
+
+/* noop */
+cl_int clRetainDevice(cl_device_id device);
+
+/* noop */
+cl_int clReleaseDevice(cl_device_id device);
+
+/* works for some parameters, asserts(false) on unsupported. Compute
+   units, clock, memory and cache sizes and vector widths are the host's,
+   from sysfs and cpuid; local memory is sized to fit a core's L2. */
 cl_int clGetDeviceInfo(cl_device_id device,
                        cl_device_info param_name,
                        size_t param_value_size,
@@ -281,19 +575,34 @@ cl_int clGetPlatformInfo(cl_platform_id platform,
                          void *param_value,
                          size_t *param_value_size_ret);
 
-/* noop */
+/* finishes the commands of the queue and releases it */
 cl_int clReleaseCommandQueue(cl_command_queue command_queue);
 
-/* noop */
+/* stops the worker threads of the context and releases it */
 cl_int clReleaseContext(cl_context context);
 
 /* noop */
 cl_int clReleaseKernel(cl_kernel kernel);
 
-/* noop */
+/* kernels created from the program stay valid */
 cl_int clReleaseProgram(cl_program program);
 
-/* noop */
+/* With FAKECL_COMPILE set in the environment, compiles the program with
+   clang, runs the clamp-pointers plugin named by CLAMP_PLUGIN if set,
+   optimizes with opt and llc and loads the result as a shared library.
+   FAKECL_CLANG_FLAGS and options are passed to clang. The options choose
+   the optimization level of opt and llc: that of their last -O flag, 0
+   with -cl-opt-disable and 3 without either; at 0 opt is not run.
+   FAKECL_OPT_FLAGS, if set, replaces the flags opt gets, and set empty
+   skips opt, leaving the IR as the plugin wrote it. FAKECL_LINK names
+   bitcode to link in, FAKECL_PLUGIN_PASSES overrides the plugin's passes
+   and FAKECL_LLC_FLAGS is passed to llc. All of these are split at
+   whitespace; the tools run without a shell. Libraries are
+   cached in FAKECL_CACHE_DIR (default /tmp/fakecl-cache-<uid>) by a hash
+   of the source, options and settings, and of the size and modification
+   time of the plugin and linked files. The executable must export the builtins
+   (link with -rdynamic). Otherwise a noop: the kernels are the ones
+   linked into the executable. */
 cl_int clBuildProgram(cl_program program,
                       cl_uint num_devices,
                       const cl_device_id *device_list,
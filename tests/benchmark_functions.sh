@@ -0,0 +1,38 @@
+# Functions shared by run_benchmarks.sh and run_microbenchmarks.sh, which
+# source this file. BENCH_RUNS is the number of runs of a measurement.
+
+# kernel time in seconds of a run, from the "kernel <t> s" line of the
+# kernel runner or the "Kernel time: <t>sec" line of the applications
+function kernel_time {
+    eval "$1" 2>&1 | sed -nE 's/^kernel ([0-9.e+-]+) s$/\1/p; s/^Kernel time: ([0-9.e+-]+)sec$/\1/p' | tail -1
+}
+
+function median {
+    printf "%s\n" $@ | sort -g | awk '{ t[NR] = $1 } END { print (NR % 2) ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2 }'
+}
+
+# runs a command BENCH_RUNS times, leaving the times in $times and their
+# median in $time
+function measure {
+    local run t
+    times=""
+    for run in $(seq $BENCH_RUNS); do
+        t=$(kernel_time "$1")
+        if [ -z "$t" ]; then
+            echo "No kernel time from: $1" >&2
+            return 1;
+        fi
+        times="$times $t"
+    done
+    time=$(median $times)
+}
+
+# clamped time divided by unclamped time
+function ratio {
+    awk -v c=$2 -v u=$1 'BEGIN { printf "%.4f", (u > 0 ? c / u : 0) }'
+}
+
+# times as a JSON array
+function json_times {
+    echo "[$(echo $@ | sed 's/ /, /g')]"
+}
@@ -0,0 +1,126 @@
+#!/usr/bin/env bash
+
+#
+# Generates an OpenCL C module of a given shape for measuring how the
+# pass scales, and prints it to stdout.
+#
+# Usage: ./generate_module.sh [-k kernels] [-f helper functions] [-p pointer arguments]
+#                             [-a allocas] [-g globals] [-n accesses] [-d call depth]
+#
+# Every kernel and helper function takes the pointer arguments and has
+# the allocas (private arrays), and makes the given number of loads and
+# stores through them. There are the given number of __constant arrays
+# and of __local arrays in each kernel. The helpers are split into call
+# depth levels: kernels call the helpers of the first level, and each
+# helper calls one of the next.
+#
+
+kernels=1
+helpers=0
+pointers=1
+allocas=0
+globals=0
+accesses=1
+depth=1
+
+while getopts "k:f:p:a:g:n:d:" option; do
+    case $option in
+        k) kernels=$OPTARG;;
+        f) helpers=$OPTARG;;
+        p) pointers=$OPTARG;;
+        a) allocas=$OPTARG;;
+        g) globals=$OPTARG;;
+        n) accesses=$OPTARG;;
+        d) depth=$OPTARG;;
+        *) sed -n '7,8s/^# //p' $0; exit 1;;
+    esac
+done
+
+[ $depth -lt 1 ] && depth=1
+[ $pointers -lt 1 ] && pointers=1
+per_level=$(( (helpers + depth - 1) / depth ))
+
+function pointer_params {
+    for p in $(seq 0 $((pointers - 1))); do
+        printf "__global int* p%d, " $p
+    done
+}
+
+function pointer_args {
+    for p in $(seq 0 $((pointers - 1))); do
+        printf "p%d, " $p
+    done
+}
+
+# the body shared by kernels and helpers: allocas and accesses, with the
+# __local arrays of kernels given in $1
+function body {
+    local locals=$1
+    for a in $(seq 0 $((allocas - 1))); do
+        printf "  int private_%d[16];\n" $a
+    done
+    for a in $(seq 0 $((allocas - 1))); do
+        printf "  private_%d[index & 15] = index;\n" $a
+    done
+    for i in $(seq 0 $((accesses - 1))); do
+        # cycle the accesses over the pointers, allocas and globals
+        local targets=$((pointers + allocas + globals + locals))
+        local t=$((i % targets))
+        if [ $t -lt $pointers ]; then
+            target="p$t"
+        elif [ $t -lt $((pointers + allocas)) ]; then
+            target="private_$((t - pointers))"
+        elif [ $t -lt $((pointers + allocas + globals)) ]; then
+            printf "  acc += constant_%d[(index + %d) & 15];\n" $((t - pointers - allocas)) $i
+            continue
+        else
+            target="local_$((t - pointers - allocas - globals))"
+        fi
+        if [ $((i % 2)) -eq 0 ]; then
+            printf "  acc += %s[(index + %d) & 15];\n" $target $i
+        else
+            printf "  %s[(index + %d) & 15] = acc;\n" $target $i
+        fi
+    done
+}
+
+echo "// generated by generate_module.sh $@"
+echo
+for g in $(seq 0 $((globals - 1))); do
+    printf "__constant int constant_%d[16] = { %d, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };\n" $g $g
+done
+echo
+
+# the deepest helpers first, so that every function is declared before
+# its callers
+for level in $(seq $((depth - 1)) -1 0); do
+    for h in $(seq 0 $((per_level - 1))); do
+        [ $((level * per_level + h)) -ge $helpers ] && continue
+        printf "int helper_%d_%d(%sint index) {\n" $level $h "$(pointer_params)"
+        echo "  int acc = 0;"
+        body 0
+        callee=$((level + 1))
+        if [ $callee -lt $depth -a $((callee * per_level + h % per_level)) -lt $helpers ]; then
+            printf "  acc += helper_%d_%d(%sindex + 1);\n" $callee $((h % per_level)) "$(pointer_args)"
+        fi
+        echo "  return acc;"
+        echo "}"
+        echo
+    done
+done
+
+for k in $(seq 0 $((kernels - 1))); do
+    printf "__kernel void kernel_%d(%s__global int* out) {\n" $k "$(pointer_params)"
+    echo "  int index = get_global_id(0);"
+    echo "  int acc = 0;"
+    for g in $(seq 0 $((globals - 1))); do
+        printf "  __local int local_%d[16];\n" $g
+    done
+    body $globals
+    for h in $(seq 0 $((per_level - 1))); do
+        [ $h -lt $helpers ] && printf "  acc += helper_0_%d(%sindex);\n" $h "$(pointer_args)"
+    done
+    echo "  out[index] = acc;"
+    echo "}"
+    echo
+done
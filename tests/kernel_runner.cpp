@@ -0,0 +1,565 @@
+//
+// Runs a kernel of an LLVM IR file over an NDRange on FakeCL, taking the
+// same arguments as run_kernel.sh:
+//
+//   kernel_runner <kernel.ll> <kernel_name> <global_work_size> "<arg1>:<arg2>:..."
+//
+// The global work size is 1 to 3 sizes separated by x, like 1024 or
+// 64x32, which give the work_dim of the NDRange.
+//
+// Each argument is (type,value) for a scalar or (type,{v1,v2,...}) for an
+// array, which the kernel gets as a buffer. Vector types take their
+// elements as (float4)(1,2,3,4).
+//
+// A __local buffer of n elements is (type,local,n).
+//
+// (type,random,n) is a buffer of n elements of pseudo-random numbers from
+// 0 up to n, whole for integer types, and the same on every run, which
+// makes data dependent loads and branches of benchmarks vary.
+//
+// Large buffers come from files, which are mapped rather than read:
+//
+//   (type,@file)      input; the kernel sees the file's data without a
+//                     copy, and its writes are not written back
+//   (type,+file)      input and output; the kernel's writes go to the file
+//   (type,>file,n)    output of n elements, creating or truncating the file
+//
+// Files are raw data in the host's byte order, or .npy arrays when they
+// start with the .npy magic; an output named *.npy gets a .npy header.
+//
+// The kernel is compiled once through FakeCL's program cache and the
+// work-items run on its worker threads, in work-groups of LOCAL_WORK_SIZE
+// if it is set, with as many sizes as the global work size. It is built
+// with the build options in BUILD_OPTIONS, which choose the optimization
+// level as described in FakeCL.h; setting FAKECL_OPT_FLAGS empty keeps the
+// IR as it is. With BENCHMARK=1 the build and
+// kernel times are printed to stderr; the kernel time covers the NDRange
+// only.
+//
+
+#include "FakeCL.h"
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#ifndef LLVM_HOST_TRIPLE
+#define LLVM_HOST_TRIPLE ""
+#endif
+
+namespace {
+  struct Argument {
+    std::string type;
+    bool is_array;
+    std::vector<char> data;
+    cl_mem buffer;
+    size_t local_size;          // in bytes, of a __local buffer
+    // a mapped file, if the data comes from one
+    void* map;
+    size_t map_size;
+    size_t data_offset;
+    size_t data_size;
+  };
+
+  double now()
+  {
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+  }
+
+  std::string trim(const std::string& s)
+  {
+    size_t begin = s.find_first_not_of(" \t\n");
+    size_t end = s.find_last_not_of(" \t\n");
+    return begin == std::string::npos ? "" : s.substr(begin, end - begin + 1);
+  }
+
+  void usage()
+  {
+    fprintf(stderr,
+            "Usage: kernel_runner <kernel.ll> <kernel_name> <global_work_size> \"<arg1>:<arg2>:...\"\n"
+            "<kernel.ll>         LLVM ll/bc file with the kernel to run.\n"
+            "<kernel_name>       Kernel to run for each work-item.\n"
+            "<global_work_size>  Number of work-items, like 1024, or 64x32 in 2 dimensions.\n"
+            "<arg1> ... <argn>   Kernel arguments as (type,value) or (type,{v1,v2,...}),\n"
+            "                    like \"(float,{1.0f,2.0f}):(int,2):(float,{0,0})\".\n");
+    exit(1);
+  }
+
+  // element size, kind ('i', 'u' or 'f', as in .npy) and vector width of
+  // an OpenCL C type, ignoring address space qualifiers and pointers
+  bool parseType(std::string type, size_t& scalar_size, size_t& width, char& kind)
+  {
+    type = trim(type);
+    size_t space = type.find_last_of(' ');
+    if (space != std::string::npos) {
+      type = type.substr(space + 1);
+    }
+    while (!type.empty() && type[type.size() - 1] == '*') {
+      type.erase(type.size() - 1);
+    }
+    size_t digits = type.find_first_of("0123456789");
+    width = digits == std::string::npos ? 1 : atoi(type.c_str() + digits);
+    std::string base = type.substr(0, digits);
+
+    static const struct { const char* name; size_t size; char kind; } types[] = {
+      { "char", 1, 'i' }, { "uchar", 1, 'u' }, { "bool", 1, 'u' },
+      { "short", 2, 'i' }, { "ushort", 2, 'u' },
+      { "int", 4, 'i' }, { "uint", 4, 'u' },
+      { "long", 8, 'i' }, { "ulong", 8, 'u' },
+      { "float", 4, 'f' }, { "double", 8, 'f' },
+    };
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+      if (base == types[i].name) {
+        scalar_size = types[i].size;
+        kind = types[i].kind;
+        return width >= 1 && width <= 16;
+      }
+    }
+    return false;
+  }
+
+  // appends a number in the representation of the given scalar type
+  void appendValue(std::vector<char>& data, const std::string& text, size_t scalar_size, char kind)
+  {
+    std::string value = trim(text);
+    if (!value.empty() && (value[value.size() - 1] == 'f' || value[value.size() - 1] == 'F') &&
+        value.compare(0, 2, "0x") != 0) {
+      value.erase(value.size() - 1);
+    }
+    char bytes[8];
+    if (kind == 'f' && scalar_size == 4) {
+      float v = (float) strtod(value.c_str(), 0);
+      memcpy(bytes, &v, 4);
+    } else if (kind == 'f') {
+      double v = strtod(value.c_str(), 0);
+      memcpy(bytes, &v, 8);
+    } else {
+      long long v = strtoll(value.c_str(), 0, 0);
+      memcpy(bytes, &v, scalar_size); // little-endian
+    }
+    data.insert(data.end(), bytes, bytes + scalar_size);
+  }
+
+  // finds the data of a .npy file, checking that it is a C ordered array
+  // of elements of the given size
+  bool parseNpy(const char* data, size_t size, size_t scalar_size, size_t& offset)
+  {
+    const char magic[] = "\x93NUMPY";
+    if (size < 10 || memcmp(data, magic, 6) != 0) {
+      return false;
+    }
+    size_t header_size;
+    if (data[6] == 1) {
+      header_size = (unsigned char) data[8] | (unsigned char) data[9] << 8;
+      offset = 10 + header_size;
+    } else {
+      if (size < 12) {
+        return false;
+      }
+      header_size = (unsigned char) data[8] | (unsigned char) data[9] << 8 |
+        (unsigned char) data[10] << 16 | (size_t) (unsigned char) data[11] << 24;
+      offset = 12 + header_size;
+    }
+    if (offset > size) {
+      return false;
+    }
+    std::string header(data + offset - header_size, header_size);
+    size_t descr = header.find("'descr'");
+    size_t quote = header.find('\'', descr + 7);
+    if (descr == std::string::npos || quote == std::string::npos ||
+        header.find("'fortran_order': True") != std::string::npos) {
+      return false;
+    }
+    // '<f4', '|u1' and the like; only the element size has to match
+    size_t end = header.find('\'', quote + 1);
+    std::string type = header.substr(quote + 1, end - quote - 1);
+    return type.size() >= 3 && type[0] != '>' && (size_t) atoi(type.c_str() + 2) == scalar_size;
+  }
+
+  // writes a version 1 .npy header for a one dimensional array
+  std::string npyHeader(size_t scalar_size, char kind, size_t count)
+  {
+    char dict[128];
+    snprintf(dict, sizeof(dict), "{'descr': '<%c%d', 'fortran_order': False, 'shape': (%lu,), }",
+             kind, (int) scalar_size, (unsigned long) count);
+    std::string header = dict;
+    // the data starts on a 64 byte boundary
+    while ((10 + header.size() + 1) % 64 != 0) {
+      header += ' ';
+    }
+    header += '\n';
+    std::string npy("\x93NUMPY\x01\x00", 8);
+    npy += (char) (header.size() & 0xff);
+    npy += (char) (header.size() >> 8);
+    return npy + header;
+  }
+
+  bool endsWith(const std::string& s, const std::string& suffix)
+  {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+  }
+
+  // maps "@file", "+file" or ">file,n" for an argument of the given
+  // element type
+  bool mapArgument(const std::string& init, Argument& arg, size_t scalar_size, size_t element_size, char kind)
+  {
+    char mode = init[0];
+    std::string path = trim(init.substr(1));
+    size_t count = 0;
+    if (mode == '>') {
+      size_t comma = path.find(',');
+      if (comma == std::string::npos) {
+        fprintf(stderr, "Output %s needs an element count\n", path.c_str());
+        return false;
+      }
+      count = strtoul(path.c_str() + comma + 1, 0, 10);
+      path = trim(path.substr(0, comma));
+    }
+
+    int fd = open(path.c_str(), mode == '@' ? O_RDONLY : mode == '+' ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      perror(path.c_str());
+      return false;
+    }
+    std::string header;
+    if (mode == '>') {
+      if (endsWith(path, ".npy")) {
+        header = npyHeader(scalar_size, kind, count * element_size / scalar_size);
+      }
+      if (ftruncate(fd, header.size() + count * element_size) != 0 ||
+          write(fd, header.data(), header.size()) != (ssize_t) header.size()) {
+        perror(path.c_str());
+        close(fd);
+        return false;
+      }
+    }
+    struct stat st;
+    fstat(fd, &st);
+    arg.map_size = st.st_size;
+
+    // an input is mapped copy-on-write, so a kernel writing to it does not
+    // change the file
+    arg.map = arg.map_size == 0 ? 0 :
+      mmap(0, arg.map_size, PROT_READ | PROT_WRITE, mode == '@' ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+    close(fd);
+    if (arg.map == MAP_FAILED || !arg.map) {
+      fprintf(stderr, "Cannot map %s\n", path.c_str());
+      arg.map = 0;
+      return false;
+    }
+
+    arg.data_offset = 0;
+    const char* data = (const char*) arg.map;
+    if (arg.map_size >= 6 && memcmp(data, "\x93NUMPY", 6) == 0 &&
+        !parseNpy(data, arg.map_size, scalar_size, arg.data_offset)) {
+      fprintf(stderr, "%s is not a C ordered .npy array of %s\n", path.c_str(), arg.type.c_str());
+      return false;
+    }
+    arg.data_size = arg.map_size - arg.data_offset;
+    if (arg.data_size == 0 || arg.data_size % element_size != 0) {
+      fprintf(stderr, "%s does not hold whole elements of %s\n", path.c_str(), arg.type.c_str());
+      return false;
+    }
+    madvise(arg.map, arg.map_size, MADV_SEQUENTIAL);
+    return true;
+  }
+
+  // appends count elements of numbers from 0 up to count, from a fixed
+  // xorshift sequence
+  void appendRandom(std::vector<char>& data, size_t count, size_t width, size_t stored_width,
+                    size_t scalar_size, char kind)
+  {
+    unsigned long long state = 88172645463325252ULL;
+    char text[32];
+    for (size_t i = 0; i < count; ++i) {
+      for (size_t j = 0; j < stored_width; ++j) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        if (j >= width) {
+          snprintf(text, sizeof(text), "0");
+        } else if (kind == 'f') {
+          snprintf(text, sizeof(text), "%.9g", (state >> 11) / 9007199254740992.0 * count);
+        } else {
+          snprintf(text, sizeof(text), "%llu", state % count);
+        }
+        appendValue(data, text, scalar_size, kind);
+      }
+    }
+  }
+
+  // parses "(type,value)" or "(type,{...})"
+  bool parseArgument(const std::string& text, Argument& arg)
+  {
+    std::string s = trim(text);
+    if (s.size() < 2 || s[0] != '(' || s[s.size() - 1] != ')') {
+      return false;
+    }
+    s = s.substr(1, s.size() - 2);
+    size_t comma = s.find(',');
+    if (comma == std::string::npos) {
+      return false;
+    }
+    arg.type = trim(s.substr(0, comma));
+    std::string init = trim(s.substr(comma + 1));
+    arg.is_array = !init.empty() && init[0] == '{';
+    arg.buffer = 0;
+    arg.local_size = 0;
+    arg.map = 0;
+
+    size_t scalar_size, width;
+    char kind;
+    if (!parseType(arg.type, scalar_size, width, kind)) {
+      fprintf(stderr, "Unsupported type: %s\n", arg.type.c_str());
+      return false;
+    }
+    // a 3 element vector takes the space of 4
+    size_t stored_width = width == 3 ? 4 : width;
+
+    if (init.compare(0, 6, "local,") == 0) {
+      arg.local_size = strtoul(init.c_str() + 6, 0, 10) * scalar_size * stored_width;
+      return arg.local_size > 0;
+    }
+    if (init.compare(0, 7, "random,") == 0) {
+      size_t count = strtoul(init.c_str() + 7, 0, 10);
+      arg.is_array = true;
+      appendRandom(arg.data, count, width, stored_width, scalar_size, kind);
+      return count > 0;
+    }
+    if (!init.empty() && (init[0] == '@' || init[0] == '+' || init[0] == '>')) {
+      arg.is_array = true;
+      return mapArgument(init, arg, scalar_size, scalar_size * stored_width, kind);
+    }
+
+    // drop braces and vector casts, leaving a flat list of numbers
+    std::string flat;
+    for (size_t i = 0; i < init.size(); ++i) {
+      if (init[i] == '(' && i + 1 < init.size() && isalpha(init[i + 1]) &&
+          init.find(')', i) != std::string::npos) {
+        i = init.find(')', i);
+      } else if (init[i] == '{' || init[i] == '}' || init[i] == '(' || init[i] == ')') {
+        flat += ' ';
+      } else {
+        flat += init[i];
+      }
+    }
+    std::vector<std::string> values;
+    std::stringstream stream(flat);
+    std::string value;
+    while (std::getline(stream, value, ',')) {
+      if (!trim(value).empty()) {
+        values.push_back(value);
+      }
+    }
+    if (values.empty() || values.size() % width != 0 || (!arg.is_array && values.size() != width)) {
+      fprintf(stderr, "Bad initializer for %s: %s\n", arg.type.c_str(), init.c_str());
+      return false;
+    }
+    for (size_t i = 0; i < values.size(); i += width) {
+      for (size_t j = 0; j < stored_width; ++j) {
+        appendValue(arg.data, j < width ? values[i + j] : "0", scalar_size, kind);
+      }
+    }
+    return true;
+  }
+
+  // the directory above the working directory that has pocl in it
+  std::string findLibraryBc()
+  {
+    if (getenv("LIBRARY_BC")) {
+      return getenv("LIBRARY_BC");
+    }
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) {
+      return "";
+    }
+    std::string dir = cwd;
+    while (!dir.empty()) {
+      std::string library = dir + "/pocl/library.bc";
+      if (access(library.c_str(), R_OK) == 0) {
+        return library;
+      }
+      dir = dir.substr(0, dir.find_last_of('/'));
+    }
+    return "";
+  }
+
+  // parses 1 to 3 sizes separated by x, returning how many there are or
+  // 0 if they are not such
+  cl_uint parseSizes(const char* text, size_t sizes[3])
+  {
+    cl_uint dims = 0;
+    const char* at = text;
+    while (dims < 3) {
+      char* end;
+      if (!isdigit(*at)) {
+        return 0;
+      }
+      sizes[dims++] = strtoul(at, &end, 10);
+      if (*end == '\0') {
+        return dims;
+      }
+      if (*end != 'x') {
+        return 0;
+      }
+      at = end + 1;
+    }
+    return 0;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc < 5) {
+    usage();
+  }
+  const char* kernel_path = argv[1];
+  const char* kernel_name = argv[2];
+  size_t global_size[3];
+  cl_uint work_dim = parseSizes(argv[3], global_size);
+  if (!work_dim) {
+    fprintf(stderr, "Bad global work size %s: give 1 to 3 sizes like 1024 or 64x32\n", argv[3]);
+    return 1;
+  }
+  size_t local_size[3];
+  const char* local_text = getenv("LOCAL_WORK_SIZE");
+  if (local_text && *local_text && parseSizes(local_text, local_size) != work_dim) {
+    fprintf(stderr, "LOCAL_WORK_SIZE %s needs %u sizes, like the global work size\n", local_text, work_dim);
+    return 1;
+  }
+  bool has_local_size = local_text && *local_text;
+
+  std::string arg_list;
+  for (int i = 4; i < argc; ++i) {
+    arg_list += (i > 4 ? ":" : "") + std::string(argv[i]);
+  }
+  std::vector<Argument> args;
+  std::stringstream stream(arg_list);
+  std::string text;
+  while (std::getline(stream, text, ':')) {
+    if (trim(text).empty()) {
+      continue;
+    }
+    Argument arg;
+    if (!parseArgument(text, arg)) {
+      fprintf(stderr, "Cannot parse argument: %s\n", text.c_str());
+      return 1;
+    }
+    fprintf(stderr, "Parameter: %s %s\n", arg.type.c_str(), trim(text).c_str());
+    args.push_back(arg);
+  }
+
+  std::ifstream file(kernel_path, std::ios::binary);
+  if (!file) {
+    fprintf(stderr, "Cannot read %s\n", kernel_path);
+    return 1;
+  }
+  std::stringstream contents;
+  contents << file.rdbuf();
+  std::string ir = contents.str();
+
+  // the kernel is already clamped, so it only needs its entry thunk, and
+  // comes from a spir triple
+  setenv("FAKECL_COMPILE", "1", 0);
+  setenv("FAKECL_PLUGIN_PASSES", "-fakecl-entry-thunks", 0);
+  std::string library_bc = findLibraryBc();
+  if (!library_bc.empty()) {
+    setenv("FAKECL_LINK", library_bc.c_str(), 0);
+  }
+  // the host triple of the LLVM the runner was built with, see Makefile
+  std::string triple = LLVM_HOST_TRIPLE;
+  if (!triple.empty()) {
+    setenv("FAKECL_LLC_FLAGS", ("-mtriple=" + triple).c_str(), 0);
+  }
+
+  cl_int err;
+  cl_device_id device;
+  clGetDeviceIDs(0, CL_DEVICE_TYPE_CPU, 1, &device, 0);
+  cl_context context = clCreateContext(0, 1, &device, 0, 0, &err);
+  cl_command_queue queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
+
+  double build_start = now();
+  const size_t length = ir.size();
+  const unsigned char* binary = (const unsigned char*) ir.data();
+  cl_program program = clCreateProgramWithBinary(context, 1, &device, &length, &binary, 0, &err);
+  const char* build_options = getenv("BUILD_OPTIONS");
+  err = clBuildProgram(program, 1, &device, build_options ? build_options : "", 0, 0);
+  double build_time = now() - build_start;
+  if (err != CL_SUCCESS) {
+    size_t size = 0;
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, 0, &size);
+    std::vector<char> log(size + 1);
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, size, &log[0], 0);
+    fprintf(stderr, "Building %s failed:\n%s\n", kernel_path, &log[0]);
+    return 1;
+  }
+
+  cl_kernel kernel = clCreateKernel(program, kernel_name, &err);
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "No kernel %s in %s\n", kernel_name, kernel_path);
+    return 1;
+  }
+  for (size_t i = 0; i < args.size(); ++i) {
+    Argument& arg = args[i];
+    if (arg.local_size) {
+      clSetKernelArg(kernel, i, arg.local_size, 0);
+    } else if (arg.map) {
+      // FakeCL runs kernels on the host, so the mapping is the buffer
+      arg.buffer = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
+                                  arg.data_size, (char*) arg.map + arg.data_offset, &err);
+      clSetKernelArg(kernel, i, sizeof(cl_mem), &arg.buffer);
+    } else if (arg.is_array) {
+      arg.buffer = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                  arg.data.size(), &arg.data[0], &err);
+      clSetKernelArg(kernel, i, sizeof(cl_mem), &arg.buffer);
+    } else if (clSetKernelArg(kernel, i, arg.data.size(), &arg.data[0]) != CL_SUCCESS) {
+      fprintf(stderr, "Argument %d of %s cannot be passed to it\n", (int) i, kernel_name);
+      return 1;
+    }
+  }
+
+  // by default a small range is one workgroup, so its output comes in
+  // work-item order
+  cl_event event;
+  err = clEnqueueNDRangeKernel(queue, kernel, work_dim, 0, global_size, has_local_size ? local_size : 0, 0, 0, &event);
+  if (err != CL_SUCCESS) {
+    fprintf(stderr, "Running %s failed with error %d\n", kernel_name, err);
+    return 1;
+  }
+  clWaitForEvents(1, &event);
+  fflush(stdout);
+
+  if (getenv("BENCHMARK") && std::string(getenv("BENCHMARK")) == "1") {
+    cl_ulong start, end;
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, 0);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, 0);
+    fprintf(stderr, "build %.6f s\nkernel %.6f s\n", build_time, (end - start) / 1e9);
+  }
+
+  clReleaseEvent(event);
+  for (size_t i = 0; i < args.size(); ++i) {
+    if (args[i].buffer) {
+      clReleaseMemObject(args[i].buffer);
+    }
+    if (args[i].map) {
+      munmap(args[i].map, args[i].map_size);
+    }
+  }
+  clReleaseKernel(kernel);
+  clReleaseProgram(program);
+  clReleaseCommandQueue(queue);
+  clReleaseContext(context);
+  return 0;
+}
@@ -0,0 +1,13 @@
+// Array of structs: each work-item updates one particle, reading and
+// writing fields of the same struct. Compare with soa.cl.
+// BENCH: aos $N "(float4,>$BENCH_DIR/particles,$N)"
+
+typedef struct {
+  float x, y, vx, vy;
+} particle;
+
+__kernel void aos(__global particle* particles) {
+  int i = get_global_id(0);
+  particles[i].x += particles[i].vx * 0.01f;
+  particles[i].y += particles[i].vy * 0.01f;
+}
@@ -0,0 +1,8 @@
+// Gather through an index array: the address of the second load depends
+// on data, so nothing about it is known at compile time.
+// BENCH: gather $N "(int,random,$N):(float,random,$N):(float,>$BENCH_DIR/out,$N):(int,$N)"
+
+__kernel void gather(__global int* index, __global float* input, __global float* output, int n) {
+  int i = get_global_id(0);
+  output[i] = input[index[i] % n];
+}
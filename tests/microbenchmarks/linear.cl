@@ -0,0 +1,9 @@
+// Linear streaming: every work-item reads and writes the element at its
+// own id. The checks are a compare per access against a limit that never
+// changes.
+// BENCH: linear $N "(float,>$BENCH_DIR/in,$N):(float,>$BENCH_DIR/out,$N):(int,$N)"
+
+__kernel void linear(__global float* input, __global float* output, int n) {
+  int i = get_global_id(0);
+  output[i] = input[i] * 2.0f + 1.0f;
+}
@@ -0,0 +1,19 @@
+// Reduction into __local memory: a tree of additions between barriers,
+// with most of the accesses going to the work-group's scratch buffer.
+// BENCH: local_reduction $N "(float,>$BENCH_DIR/in,$N):(float,local,64):(float,>$BENCH_DIR/out,$NUM_GROUPS)"
+// BENCH_LOCAL_SIZE: 64
+
+__kernel void local_reduction(__global float* input, __local float* scratch, __global float* output) {
+  int lid = get_local_id(0);
+  scratch[lid] = input[get_global_id(0)];
+  barrier(CLK_LOCAL_MEM_FENCE);
+  for (int offset = get_local_size(0) / 2; offset > 0; offset /= 2) {
+    if (lid < offset) {
+      scratch[lid] += scratch[lid + offset];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+  if (lid == 0) {
+    output[get_group_id(0)] = scratch[0];
+  }
+}
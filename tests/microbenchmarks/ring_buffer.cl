@@ -0,0 +1,15 @@
+// Ring buffer with a masked index: the index is always in bounds, but
+// only if the pass understands that the mask is smaller than the buffer.
+// BENCH: ring_buffer $N "(float,>$BENCH_DIR/ring,4096):(float,>$BENCH_DIR/out,$N)"
+
+#define RING_MASK 4095
+#define TAPS 8
+
+__kernel void ring_buffer(__global float* ring, __global float* output) {
+  int i = get_global_id(0);
+  float sum = 0.0f;
+  for (int tap = 0; tap < TAPS; tap++) {
+    sum += ring[(i + tap) & RING_MASK];
+  }
+  output[i] = sum;
+}
@@ -0,0 +1,9 @@
+// Struct of arrays: the same update as aos.cl, with each field in an
+// array of its own, so every access goes through a different pointer.
+// BENCH: soa $N "(float,>$BENCH_DIR/x,$N):(float,>$BENCH_DIR/y,$N):(float,>$BENCH_DIR/vx,$N):(float,>$BENCH_DIR/vy,$N)"
+
+__kernel void soa(__global float* x, __global float* y, __global float* vx, __global float* vy) {
+  int i = get_global_id(0);
+  x[i] += vx[i] * 0.01f;
+  y[i] += vy[i] * 0.01f;
+}
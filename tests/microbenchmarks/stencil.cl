@@ -0,0 +1,14 @@
+// 5-point stencil on a 1024 wide grid: five loads around each point, of
+// which the pass may be able to prove some in bounds from the others.
+// BENCH: stencil $N "(float,>$BENCH_DIR/in,$N):(float,>$BENCH_DIR/out,$N):(int,1024):(int,$N)"
+
+__kernel void stencil(__global float* input, __global float* output, int width, int n) {
+  int i = get_global_id(0);
+  int x = i % width;
+  if (x == 0 || x == width - 1 || i < width || i >= n - width) {
+    output[i] = input[i];
+    return;
+  }
+  output[i] = 0.5f * input[i] +
+    0.125f * (input[i - 1] + input[i + 1] + input[i - width] + input[i + width]);
+}
@@ -0,0 +1,10 @@
+// Strided access: work-item i reads element i * 17 modulo n, so
+// consecutive work-items touch different cache lines.
+// BENCH: strided $N "(float,>$BENCH_DIR/in,$N):(float,>$BENCH_DIR/out,$N):(int,$N)"
+
+#define STRIDE 17
+
+__kernel void strided(__global float* input, __global float* output, int n) {
+  int i = get_global_id(0);
+  output[i] = input[(i * STRIDE) % n] * 2.0f;
+}
@@ -10,6 +10,7 @@
 OpenCL::OpenCL(int displayOutput)
 {
 	VERBOSE = displayOutput;
+	kernelNs = 0;
 }
 
 OpenCL::~OpenCL()
@@ -17,6 +18,7 @@ OpenCL::~OpenCL()
 	// Flush and kill the command queue...
 	clFlush(command_queue);
 	clFinish(command_queue);
+	kernelTime();
 	
 	// Release each kernel in the map kernelArray
 	map<string, cl_kernel>::iterator it;
@@ -36,6 +38,23 @@ size_t OpenCL::localSize()
 	return this->lwsize;
 }
 
+// Returns the time in seconds the launched kernels have run so far,
+// measured by the device, so host setup and copies are not included.
+double OpenCL::kernelTime()
+{
+	for (size_t i = 0; i < launchEvents.size(); i++)
+	{
+		cl_ulong start = 0, end = 0;
+		clWaitForEvents(1, &launchEvents[i]);
+		clGetEventProfilingInfo(launchEvents[i], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+		clGetEventProfilingInfo(launchEvents[i], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+		kernelNs += end - start;
+		clReleaseEvent(launchEvents[i]);
+	}
+	launchEvents.clear();
+	return kernelNs * 1e-9;
+}
+
 cl_command_queue OpenCL::q()
 {
 	return this->command_queue;
@@ -44,6 +63,7 @@ cl_command_queue OpenCL::q()
 void OpenCL::launch(string toLaunch)
 {
 	// Launch the kernel (or at least enqueue it).
+	cl_event event;
 	ret = clEnqueueNDRangeKernel(command_queue, 
 	                             kernelArray[toLaunch],
 	                             1,
@@ -52,13 +72,14 @@ void OpenCL::launch(string toLaunch)
 	                             &lwsize,
 	                             0, 
 	                             NULL, 
-	                             NULL);
+	                             &event);
 	
 	if (ret != CL_SUCCESS)
 	{
 		printf("\nError attempting to launch %s. Error in clCreateProgramWithSource with error code %i\n\n", toLaunch.c_str(), ret);
 		exit(1);
 	}
+	launchEvents.push_back(event);
 }
 
 void OpenCL::gwSize(size_t theSize)
@@ -343,7 +364,7 @@ void OpenCL::getDevices(cl_device_type deviceType)
 	}
  
 	// Create a command queue.
-	command_queue = clCreateCommandQueue(context, device_id[0], 0, &ret);
+	command_queue = clCreateCommandQueue(context, device_id[0], CL_QUEUE_PROFILING_ENABLE, &ret);
 	if (ret != CL_SUCCESS)
 	{
 		printf("\nError at clCreateCommandQueue! Error code %i\n\n", ret);
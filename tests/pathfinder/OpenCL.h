@@ -3,6 +3,7 @@
 #include <map>
 #include <string>
 #include <cstring>
+#include <vector>
 
 #ifdef USE_FAKECL
 #include "FakeCL.h"
@@ -36,6 +37,7 @@ public:
 	cl_command_queue q();
 	void launch(string toLaunch);
 	size_t localSize();
+	double kernelTime();
 
 	void saveProgram(const char* filename);
 	
@@ -50,6 +52,8 @@ private:
 	cl_context              context;
 	cl_command_queue        command_queue;
 	cl_program              program;
+	vector<cl_event>        launchEvents;      // Profiling events of the launches not yet counted in kernelNs.
+	cl_ulong                kernelNs;          // Time spent in kernels, in nanoseconds.
 	
 	void getDevices(cl_device_type deviceType);
 	void buildKernel();
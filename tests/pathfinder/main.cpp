@@ -213,6 +213,9 @@ int main(int argc, char** argv)
 	
 	// Tack a null terminator at the end of the string.
 	h_outputBuffer[16383] = '\0';
+
+	// Stdout is the result, so report the time on stderr.
+	fprintf(stderr, "Kernel time: %.5fsec\n", cl.kernelTime());
 	
 #ifdef BENCH_PRINT
 	for (int i = 0; i < cols; i++)
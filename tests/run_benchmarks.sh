@@ -0,0 +1,161 @@
+#!/usr/bin/env bash
+
+#set -x
+
+#
+# Measures the run time overhead of clamping. Each benchmark is built
+# from -O0 and from -O3 code, unclamped and clamped, and every build is
+# run BENCH_RUNS times. The overhead of an optimization level is the
+# median kernel time of the clamped build divided by that of the
+# unclamped one; the script fails if any overhead is above
+# BENCH_THRESHOLD. Results are written as JSON to BENCH_OUTPUT.
+#
+# Kernels run by kernel_runner are not optimized again by FakeCL, and llc
+# compiles them at the level of their row, so each row measures the code
+# it names.
+#
+# Usage: ./run_benchmarks.sh [performance|synthetic|kmeans|pathfinder ...]
+#
+
+[ -z "$BENCH_RUNS" ] && BENCH_RUNS=5
+[ -z "$BENCH_THRESHOLD" ] && BENCH_THRESHOLD=1.30
+[ -z "$BENCH_OUTPUT" ] && BENCH_OUTPUT=$PWD/benchmark_results.json
+# work-items of the synthetic benchmark, each of which reads 64 floats
+[ -z "$BENCH_SYNTHETIC_ITEMS" ] && BENCH_SYNTHETIC_ITEMS=4096
+
+current_dir=$(pwd)
+temp_dir=$current_dir/bench_temp
+mkdir -p $temp_dir
+
+if [ -z "$CLAMP_PLUGIN" -o ! -r "$CLAMP_PLUGIN" ]; then
+    echo "CLAMP_PLUGIN variable must be set to point the loadable plugin module (absolute path)"
+    exit 1;
+fi
+
+export CLAMP_PLUGIN
+export OCLANG=$PWD/oclang.sh
+make -s kernel_runner || exit 1;
+RUNNER=$PWD/kernel_runner
+
+if [ -z $1 ]; then
+    benchmarks="performance synthetic kmeans pathfinder"
+else
+    benchmarks=$@
+fi
+
+results=""
+failed=""
+
+. ./benchmark_functions.sh
+
+# measures the unclamped and clamped commands of a benchmark at an
+# optimization level and records the overhead
+function compare {
+    name=$1
+    level=$2
+    echo "########################### ------------- $name $level ..."
+    measure "$3" || { failed="$failed $name.$level"; return; }
+    unclamped_times=$times
+    unclamped=$time
+    measure "$4" || { failed="$failed $name.$level"; return; }
+    clamped_times=$times
+    clamped=$time
+
+    overhead=$(ratio $unclamped $clamped)
+    ok=true
+    if awk -v o=$overhead -v t=$BENCH_THRESHOLD 'BEGIN { exit !(o > t) }'; then
+        ok=false
+        failed="$failed $name.$level"
+    fi
+    echo "unclamped $unclamped s, clamped $clamped s, overhead $overhead"
+    [ -n "$results" ] && results="$results,"
+    results="$results
+    { \"benchmark\": \"$name\", \"optimization\": \"$level\",
+      \"unclamped\": { \"median\": $unclamped, \"times\": $(json_times $unclamped_times) },
+      \"clamped\": { \"median\": $clamped, \"times\": $(json_times $clamped_times) },
+      \"overhead\": $overhead, \"passed\": $ok }"
+}
+
+# clamps $OUT_FILE.O0.ll and its -O3 version
+function clamp_ir {
+    opt -S -O3 $OUT_FILE.O0.ll -o $OUT_FILE.O3.ll &&
+    opt -S -load $CLAMP_PLUGIN -clamp-pointers $OUT_FILE.O0.ll -o $OUT_FILE.O0.clamped.ll &&
+    opt -S -load $CLAMP_PLUGIN -clamp-pointers $OUT_FILE.O3.ll -o $OUT_FILE.O3.clamped.ll
+}
+
+function bench_performance {
+    OUT_FILE=$temp_dir/test_performance.cl
+    clang -target spir -S -c test_performance.cl -O0 -emit-llvm -o $OUT_FILE.O0.ll &&
+    clamp_ir || return 1;
+    for level in O0 O3; do
+        run="FAKECL_OPT_FLAGS= BUILD_OPTIONS=-$level BENCHMARK=1 $RUNNER"
+        compare performance $level \
+            "$run $OUT_FILE.$level.ll test_kernel 1 '(int,{0})'" \
+            "$run $OUT_FILE.$level.clamped.ll test_kernel 1 '(int,{0}):(int,1)'"
+    done
+}
+
+function bench_synthetic {
+    OUT_FILE=$temp_dir/test_synthetic_benchmark.cl
+    $OCLANG -S -c test_synthetic_benchmark.cl -O0 -emit-llvm -o $OUT_FILE.O0.ll > /dev/null &&
+    clamp_ir || return 1;
+    size=$(expr $BENCH_SYNTHETIC_ITEMS \* 64)
+    # pseudo-random input, so that its data dependent branches vary
+    input="(float,random,$size)"
+    output="(float,>$temp_dir/synthetic.out,$size)"
+    for level in O0 O3; do
+        run="FAKECL_OPT_FLAGS= BUILD_OPTIONS=-$level BENCHMARK=1 $RUNNER"
+        compare synthetic $level \
+            "$run $OUT_FILE.$level.ll square $BENCH_SYNTHETIC_ITEMS '$input:(int,$size):$output:(int,$size)'" \
+            "$run $OUT_FILE.$level.clamped.ll square $BENCH_SYNTHETIC_ITEMS '$input:(int,$size):(int,$size):$output:(int,$size):(int,$size)'"
+    done
+}
+
+# builds an application once for each optimization level, unclamped and
+# clamped, and runs it in its directory
+function bench_application {
+    name=$1
+    directory=$2
+    shift 2
+    for level in O0 O3; do
+        for safe in "" 1; do
+            binary=$temp_dir/$name.$level${safe:+.clamped}
+            ( cd $directory && make -s clean && make -s SAFE=$safe KERNEL_OPT=-$level $make_flags $name &&
+              cp $name $binary ) > /dev/null || return 1;
+        done
+        compare $name $level "(cd $directory && $temp_dir/$name.$level $*)" "(cd $directory && $temp_dir/$name.$level.clamped $*)"
+    done
+    make -s -C $directory clean
+}
+
+function bench_kmeans {
+    [ -r kmeans/kdd_cup ] || bunzip2 -k kmeans/kdd_cup.bz2 || return 1;
+    make_flags="" bench_application kmeans kmeans -o -i kdd_cup
+}
+
+function bench_pathfinder {
+    make_flags="USE_FAKECL=1" bench_application pathfinder pathfinder 100000 100 20
+}
+
+rm -f $temp_dir/*
+for benchmark in $benchmarks; do
+    bench_$benchmark || failed="$failed $benchmark";
+done
+
+cat > $BENCH_OUTPUT <<EOF
+{
+  "runs": $BENCH_RUNS,
+  "threshold": $BENCH_THRESHOLD,
+  "results": [$results
+  ]
+}
+EOF
+echo "Results written to $BENCH_OUTPUT"
+
+if [ ! -z "$failed" ]; then
+    echo "###################### FAIL ###################################";
+    echo "## Failed benchmarks: $failed";
+    exit 1;
+else
+    echo "###################### ALL GOOD ###############################";
+fi
@@ -0,0 +1,124 @@
+#!/usr/bin/env bash
+
+#set -x
+
+#
+# Measures how the compile time and memory use of -clamp-pointers grow
+# with the size of the module. For each shape parameter of
+# generate_module.sh, the parameter is scaled by each of SCALES while the
+# others keep their base values, and the wall time and peak RSS of opt
+# are recorded. The growth of each curve is summarized as an exponent:
+# about 1 is linear, 2 quadratic. Results are written as JSON to
+# BENCH_OUTPUT.
+#
+# Usage: ./run_compile_benchmarks.sh [kernels|helpers|pointers|allocas|globals|accesses|depth ...]
+#
+
+[ -z "$SCALES" ] && SCALES="1 2 4 8 16"
+[ -z "$BENCH_OUTPUT" ] && BENCH_OUTPUT=$PWD/compile_benchmark_results.json
+
+current_dir=$(pwd)
+temp_dir=$current_dir/bench_temp
+mkdir -p $temp_dir
+
+if [ -z "$CLAMP_PLUGIN" -o ! -r "$CLAMP_PLUGIN" ]; then
+    echo "CLAMP_PLUGIN variable must be set to point the loadable plugin module (absolute path)"
+    exit 1;
+fi
+
+export OCLANG=$PWD/oclang.sh
+
+if [ -z $1 ]; then
+    parameters="kernels helpers pointers allocas globals accesses depth"
+else
+    parameters=$@
+fi
+
+# base values and generate_module.sh switches of the parameters
+function base {
+    case $1 in
+        kernels) echo 2;; helpers) echo 8;; pointers) echo 4;; allocas) echo 2;;
+        globals) echo 2;; accesses) echo 16;; depth) echo 2;;
+        *) return 1;;
+    esac
+}
+
+function switch {
+    case $1 in
+        kernels) echo -k;; helpers) echo -f;; pointers) echo -p;; allocas) echo -a;;
+        globals) echo -g;; accesses) echo -n;; depth) echo -d;;
+    esac
+}
+
+# runs a command, leaving its wall time in seconds in $wall and its peak
+# RSS in kilobytes in $rss, which is null without GNU time
+function measure_command {
+    if [ -x /usr/bin/time ]; then
+        /usr/bin/time -f "%e %M" -o $temp_dir/time "$@" > /dev/null 2>&1
+        read wall rss < $temp_dir/time
+    else
+        local start=$(date +%s.%N)
+        "$@" > /dev/null 2>&1
+        wall=$(echo "$start $(date +%s.%N)" | awk '{ printf "%.3f", $2 - $1 }')
+        rss=null
+    fi
+}
+
+results=""
+failed=""
+
+rm -f $temp_dir/*
+printf "%-10s %8s %10s %12s\n" parameter value "time (s)" "rss (kB)"
+for parameter in $parameters; do
+    if ! base $parameter > /dev/null; then
+        echo "Unknown parameter: $parameter";
+        exit 1;
+    fi
+    points=""
+    first=""
+    for scale in $SCALES; do
+        flags=""
+        for p in kernels helpers pointers allocas globals accesses depth; do
+            value=$(base $p)
+            [ $p = $parameter ] && value=$(expr $value \* $scale)
+            flags="$flags $(switch $p) $value"
+        done
+        value=$(expr $(base $parameter) \* $scale)
+        module=$temp_dir/$parameter.$value
+        ./generate_module.sh $flags > $module.cl &&
+        $OCLANG -S -c $module.cl -O0 -emit-llvm -o $module.ll > /dev/null || { failed="$failed $parameter.$value"; continue; }
+
+        measure_command opt -load $CLAMP_PLUGIN -clamp-pointers -S $module.ll -o $module.clamped.ll
+        if [ ! -s $module.clamped.ll ]; then
+            failed="$failed $parameter.$value"
+            continue
+        fi
+        printf "%-10s %8s %10s %12s\n" $parameter $value $wall $rss
+        [ -n "$points" ] && points="$points,"
+        points="$points
+        { \"value\": $value, \"time\": $wall, \"rss\": $rss }"
+        [ -z "$first" ] && first="$value $wall"
+        last="$value $wall"
+    done
+    # slope of the curve on a log-log scale between its ends
+    exponent=$(echo "$first $last" | awk '{ printf "%.2f", ($4 > 0 && $2 > 0 && $3 > $1) ? log($4 / $2) / log($3 / $1) : 0 }')
+    echo "$parameter: time grows as $parameter^$exponent"
+    [ -n "$results" ] && results="$results,"
+    results="$results
+    { \"parameter\": \"$parameter\", \"exponent\": $exponent, \"points\": [$points
+      ] }"
+done
+
+cat > $BENCH_OUTPUT <<EOF
+{
+  "scales": [$(echo $SCALES | sed 's/ /, /g')],
+  "results": [$results
+  ]
+}
+EOF
+echo "Results written to $BENCH_OUTPUT"
+
+if [ ! -z "$failed" ]; then
+    echo "## Failed: $failed";
+    exit 1;
+fi
@@ -0,0 +1,147 @@
+#!/usr/bin/env bash
+
+#set -x
+
+#
+# Times the micro-kernels in microbenchmarks/, one memory access pattern
+# each, unclamped and clamped with each lowering in CLAMP_MODES. Prints
+# the median kernel time of every build with its ratio to the unclamped
+# one, and writes them as JSON to BENCH_OUTPUT.
+#
+# Each kernel has a line
+#
+#   // BENCH: <kernel> <global_work_size> "<arguments>"
+#
+# and optionally "// BENCH_LOCAL_SIZE: <work-group size>". The arguments
+# are those of kernel_runner for the unclamped kernel, with $N for the
+# problem size, $NUM_GROUPS for the number of work-groups and $BENCH_DIR
+# for a directory for the buffers' files. Buffers must be (type,>file,n),
+# (type,random,n) or (type,local,n); the clamped kernels get n after each
+# of them.
+#
+# Usage: ./run_microbenchmarks.sh [microbenchmarks/<pattern>.cl ...]
+#
+
+[ -z "$BENCH_RUNS" ] && BENCH_RUNS=5
+[ -z "$BENCH_OUTPUT" ] && BENCH_OUTPUT=$PWD/microbenchmark_results.json
+# elements processed by each kernel
+[ -z "$MICROBENCH_SIZE" ] && MICROBENCH_SIZE=1048576
+# clamp lowerings to compare, see mode_flags
+[ -z "$CLAMP_MODES" ] && CLAMP_MODES="branch clamp auto"
+
+current_dir=$(pwd)
+temp_dir=$current_dir/bench_temp
+mkdir -p $temp_dir
+
+if [ -z "$CLAMP_PLUGIN" -o ! -r "$CLAMP_PLUGIN" ]; then
+    echo "CLAMP_PLUGIN variable must be set to point the loadable plugin module (absolute path)"
+    exit 1;
+fi
+
+export CLAMP_PLUGIN
+export OCLANG=$PWD/oclang.sh
+make -s kernel_runner || exit 1;
+RUNNER=$PWD/kernel_runner
+
+if [ -z $1 ]; then
+    kernels=$(ls -1 microbenchmarks/*.cl);
+else
+    kernels=$@;
+fi
+
+. ./benchmark_functions.sh
+
+# opt flags of a clamp lowering
+function mode_flags {
+    case $1 in
+        branch) echo "-clamp-pointers -clamp-pointers-strategy=branch";;
+        clamp) echo "-clamp-pointers -clamp-pointers-strategy=clamp";;
+        auto) echo "-clamp-pointers -clamp-pointers-strategy=auto";;
+        *) return 1;;
+    esac
+}
+
+for mode in $CLAMP_MODES; do
+    if ! mode_flags $mode > /dev/null; then
+        echo "Unknown clamp mode: $mode";
+        exit 1;
+    fi
+done
+
+# the arguments of the clamped kernel
+function clamped_arguments {
+    local IFS=":"
+    local clamped=""
+    for arg in $1; do
+        clamped="$clamped:$arg"
+        if echo "$arg" | grep -qE '^\([^,]+,(>[^,]+|random|local),[0-9]+\)$'; then
+            clamped="$clamped:(int,$(echo "$arg" | sed -E 's/.*,([0-9]+)\)$/\1/'))"
+        elif echo "$arg" | grep -qE '^\([^,]+,[{@+>]'; then
+            echo "Cannot count the elements of $arg" >&2
+            return 1;
+        fi
+    done
+    echo "${clamped#:}"
+}
+
+results=""
+failed=""
+N=$MICROBENCH_SIZE
+BENCH_DIR=$temp_dir
+
+rm -f $temp_dir/*
+printf "%-20s %12s" pattern unclamped
+for mode in $CLAMP_MODES; do
+    printf " %22s" $mode
+done
+printf "\n"
+
+for kernel_file in $kernels; do
+    name=$(basename $kernel_file .cl)
+    out_file=$temp_dir/$name
+    local_size=$(sed -nE 's@^//\s*BENCH_LOCAL_SIZE:\s*([0-9]+).*@\1@p' $kernel_file)
+    NUM_GROUPS=$(expr $N / ${local_size:-1})
+    eval "bench=($(sed -nE 's@^//\s*BENCH:\s*(.+)@\1@p' $kernel_file))"
+    arguments=${bench[2]}
+    clamped=$(clamped_arguments "$arguments") &&
+    $OCLANG -S -c $kernel_file -O0 -emit-llvm -o $out_file.ll > /dev/null &&
+    run="LOCAL_WORK_SIZE=$local_size BENCHMARK=1 $RUNNER" &&
+    measure "$run $out_file.ll ${bench[0]} ${bench[1]} '$arguments'" || { failed="$failed $name"; continue; }
+    unclamped_times=$times
+    unclamped=$time
+    modes=""
+    printf "%-20s %12s" $name $unclamped
+    for mode in $CLAMP_MODES; do
+        if opt -load $CLAMP_PLUGIN $(mode_flags $mode) -S $out_file.ll -o $out_file.$mode.ll &&
+           measure "$run $out_file.$mode.ll ${bench[0]} ${bench[1]} '$clamped'"; then
+            printf " %12s (%6sx)" $time $(ratio $unclamped $time)
+            [ -n "$modes" ] && modes="$modes,"
+            modes="$modes
+        \"$mode\": { \"median\": $time, \"times\": $(json_times $times), \"ratio\": $(ratio $unclamped $time) }"
+        else
+            printf " %22s" failed
+            failed="$failed $name.$mode"
+        fi
+    done
+    printf "\n"
+    [ -n "$results" ] && results="$results,"
+    results="$results
+    { \"pattern\": \"$name\", \"size\": $N,
+      \"unclamped\": { \"median\": $unclamped, \"times\": $(json_times $unclamped_times) },
+      \"modes\": {$modes
+      } }"
+done
+
+cat > $BENCH_OUTPUT <<EOF
+{
+  "runs": $BENCH_RUNS,
+  "results": [$results
+  ]
+}
+EOF
+echo "Results written to $BENCH_OUTPUT"
+
+if [ ! -z "$failed" ]; then
+    echo "## Failed: $failed";
+    exit 1;
+fi
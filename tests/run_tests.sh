@@ -27,8 +27,19 @@ fi
 
 cd $current_dir;
 
+export CLAMP_PLUGIN
 export OCLANG=$PWD/oclang.sh
-export RUN_KERNEL=$PWD/run_kernel.sh
+
+# kernels run with lli by default. RUN_KERNEL=$PWD/kernel_runner runs them
+# on FakeCL's workers instead, where printf output of work-items is not in
+# order and writes past a buffer may corrupt the heap without crashing.
+# Tests of FakeCL's own features use KERNEL_RUNNER.
+make -s kernel_runner || exit 1;
+export KERNEL_RUNNER=$PWD/kernel_runner
+if [ -z "$RUN_KERNEL" ]; then
+    RUN_KERNEL=$PWD/run_kernel.sh
+fi
+export RUN_KERNEL
 
 failed_tests=""
 
@@ -0,0 +1,16 @@
+// RUN: echo "Testing that check code has the source location of the access it guards." &&
+// RUN: $OCLANG $TEST_SRC -g -S -o $OUT_FILE.ll &&
+// RUN: opt -load $CLAMP_PLUGIN -clamp-pointers -clamp-pointers-check-table=$OUT_FILE.table -S $OUT_FILE.ll -o $OUT_FILE.clamped.ll &&
+// RUN: ( grep -E "^[0-9]+ [^ ]+ .*test_check_locations.cl:14:[1-9][0-9]* load branch$" $OUT_FILE.table > /dev/null || (echo "The load is not in the check table." && false) ) &&
+// RUN: ( grep -E "^[0-9]+ [^ ]+ .*test_check_locations.cl:14:[1-9][0-9]* store branch$" $OUT_FILE.table > /dev/null || (echo "The store is not in the check table." && false) ) &&
+// RUN: ( ! ( grep -E "= icmp u[gl]t " $OUT_FILE.clamped.ll | grep -v "!dbg" > /dev/null ) || (echo "Check compares have no debug location." && false) ) &&
+// RUN: ( grep -E "br i1 .*, !dbg" $OUT_FILE.clamped.ll > /dev/null || (echo "Check branches have no debug location." && false) ) &&
+// RUN: ( grep -E "metadata !\{i32 14, i32 0, " $OUT_FILE.clamped.ll > /dev/null || (echo "Check code is not at column 0 of the access's line." && false) ) &&
+// RUN: opt -load $CLAMP_PLUGIN -clamp-pointers -clamp-pointers-strategy=clamp -S $OUT_FILE.ll -o $OUT_FILE.clamp.ll &&
+// RUN: ( grep -E "%clamped.load.[0-9]+ = select .*, !dbg" $OUT_FILE.clamp.ll > /dev/null || (echo "Clamps have no debug location." && false) )
+
+__kernel void square(__global float* input, __global float* output) {
+  int i = get_global_id(0);
+
+  output[i] = input[i]*input[i];
+}
@@ -0,0 +1,22 @@
+// RUN: echo "Testing that boundary checks can be profiled and the profile used for branch weights." &&
+// RUN: $OCLANG $TEST_SRC -S -o $OUT_FILE.ll &&
+// RUN: opt -load $CLAMP_PLUGIN -clamp-pointers -clamp-pointers-profile -S $OUT_FILE.ll -o $OUT_FILE.clamped.ll &&
+// RUN: grep "@__clamp_profile_counters = global" $OUT_FILE.clamped.ll > /dev/null &&
+// RUN: grep "@__clamp_profile_checks = constant" $OUT_FILE.clamped.ll > /dev/null &&
+// RUN: grep "atomicrmw add" $OUT_FILE.clamped.ll > /dev/null &&
+// RUN: rm -f $OUT_FILE.profile &&
+// RUN: FAKECL_CLAMP_PROFILE=$OUT_FILE.profile $KERNEL_RUNNER $OUT_FILE.clamped.ll square 5 "(float,{1.0f,2.0f,3.0f,4.0f}):(int,4):(float,{0,0,0,0,0}):(int,5)" &&
+// RUN: ( grep -E "^[0-9]+ 5 1 load " $OUT_FILE.profile > /dev/null || (echo "Failed reads were not counted." && false) ) &&
+// RUN: ( grep -E "^[0-9]+ 5 0 store " $OUT_FILE.profile > /dev/null || (echo "Stores were not counted." && false) ) &&
+// RUN: opt -load $CLAMP_PLUGIN -clamp-pointers -clamp-pointers-profile-use=$OUT_FILE.profile -S $OUT_FILE.ll -o $OUT_FILE.weighted.ll &&
+// RUN: ( grep "!prof" $OUT_FILE.weighted.ll > /dev/null || (echo "Checks have no branch weights." && false) ) &&
+// RUN: opt -load $CLAMP_PLUGIN -clamp-pointers -clamp-pointers-strategy=clamp -clamp-pointers-profile -S $OUT_FILE.ll -o $OUT_FILE.clamp.ll &&
+// RUN: ( grep "^boundary.check.record.load" $OUT_FILE.clamp.ll > /dev/null || (echo "Clamped failures are not counted on the failing edge." && false) ) &&
+// RUN: rm -f $OUT_FILE.clamp.profile &&
+// RUN: FAKECL_CLAMP_PROFILE=$OUT_FILE.clamp.profile $KERNEL_RUNNER $OUT_FILE.clamp.ll square 5 "(float,{1.0f,2.0f,3.0f,4.0f}):(int,4):(float,{0,0,0,0,0}):(int,5)" &&
+// RUN: ( grep -E "^[0-9]+ 5 1 load " $OUT_FILE.clamp.profile > /dev/null || (echo "Failed clamped reads were not counted." && false) )
+
+__kernel void square(__global float* input, __global float* output) {
+  int i = get_global_id(0);
+  output[i] = input[i]*input[i];
+}
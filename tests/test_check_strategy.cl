@@ -0,0 +1,22 @@
+// RUN: echo "Testing that boundary checks can be lowered to clamps and chosen by cost." &&
+// RUN: $OCLANG $TEST_SRC -S -o $OUT_FILE.ll &&
+// RUN: opt -load $CLAMP_PLUGIN -clamp-pointers -clamp-pointers-strategy=clamp -S $OUT_FILE.ll -o $OUT_FILE.clamp.ll &&
+// RUN: ( ! grep "boundary.check.ok" $OUT_FILE.clamp.ll > /dev/null || (echo "Clamped checks have branches." && false) ) &&
+// RUN: grep "%clamped.[a-z]*.[0-9]* = select" $OUT_FILE.clamp.ll > /dev/null &&
+// RUN: ( $RUN_KERNEL $OUT_FILE.clamp.ll sum 2 "(float,{1.0f,2.0f,3.0f,4.0f,5.0f}):(int,5):(float,{0,0}):(int,2)" | grep "10.000000,9.000000," ||
+// RUN:   (echo "Unexpected output from the clamped kernel." && false) ) &&
+// RUN: opt -load $CLAMP_PLUGIN -clamp-pointers -clamp-pointers-strategy=auto -clamp-pointers-check-report -S $OUT_FILE.ll -o $OUT_FILE.auto.ll 2> $OUT_FILE.report &&
+// RUN: ( grep -E "^  [0-9]+ load clamp hoisted depth 1 " $OUT_FILE.report > /dev/null || (echo "The load in the loop was not clamped." && false) ) &&
+// RUN: ( grep -E "^  [0-9]+ store branch depth 0 " $OUT_FILE.report > /dev/null || (echo "The store outside the loop was not branched." && false) ) &&
+// RUN: ( $RUN_KERNEL $OUT_FILE.auto.ll sum 2 "(float,{1.0f,2.0f,3.0f,4.0f,5.0f}):(int,5):(float,{0,0}):(int,2)" | grep "10.000000,9.000000," ||
+// RUN:   (echo "Unexpected output from the kernel lowered by cost." && false) )
+
+// reads past the end of input for the second work-item
+__kernel void sum(__global float* input, __global float* output) {
+  int i = get_global_id(0);
+  float total = 0;
+  for (int j = 0; j < 16; j++) {
+    total += input[i * 3 + j % 4];
+  }
+  output[i] = total / 4;
+}
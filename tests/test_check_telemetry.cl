@@ -0,0 +1,16 @@
+// RUN: echo "Testing that failing boundary checks are recorded and reported after the launch." &&
+// RUN: $OCLANG $TEST_SRC -S -o $OUT_FILE.ll &&
+// RUN: opt -load $CLAMP_PLUGIN -clamp-pointers -clamp-pointers-telemetry -clamp-pointers-telemetry-size=2 -S $OUT_FILE.ll -o $OUT_FILE.clamped.ll &&
+// RUN: grep "@__clamp_telemetry_records = global \[3 x" $OUT_FILE.clamped.ll > /dev/null &&
+// RUN: ( ! ( $KERNEL_RUNNER $OUT_FILE.clamped.ll square 5 "(float,{1.0f,2.0f,3.0f,4.0f,5.0f}):(int,5):(float,{0,0,0,0,0}):(int,5)" 2>&1 > /dev/null | grep "boundary check" > /dev/null ) ||
+// RUN:   (echo "Checks failed without an out of bounds access." && false) ) &&
+// RUN: $KERNEL_RUNNER $OUT_FILE.clamped.ll square 5 "(float,{1.0f,2.0f,3.0f,4.0f}):(int,4):(float,{0,0,0,0,0}):(int,5)" 2> $OUT_FILE.violations > /dev/null &&
+// RUN: ( grep -E "boundary check [0-9]+ failed for work-item \(4,0,0\)" $OUT_FILE.violations > /dev/null || (echo "The failure was not reported." && false) ) &&
+// RUN: opt -load $CLAMP_PLUGIN -clamp-pointers -clamp-pointers-strategy=clamp -clamp-pointers-telemetry -S $OUT_FILE.ll -o $OUT_FILE.clamp.ll &&
+// RUN: $KERNEL_RUNNER $OUT_FILE.clamp.ll square 5 "(float,{1.0f,2.0f,3.0f,4.0f}):(int,4):(float,{0,0,0,0,0}):(int,5)" 2> $OUT_FILE.clamp.violations > /dev/null &&
+// RUN: ( grep -E "boundary check [0-9]+ failed for work-item \(4,0,0\)" $OUT_FILE.clamp.violations > /dev/null || (echo "The failure of a clamping check was not reported." && false) )
+
+__kernel void square(__global float* input, __global float* output) {
+  int i = get_global_id(0);
+  output[i] = input[i]*input[i];
+}
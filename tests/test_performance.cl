@@ -19,7 +19,7 @@
 // The output is a 44100Hz 16bit stereo PCM file.
 
 // NOTE: for now looks like -O3 cripples safe exception load/store analysis
-// TODO: get times from unclamped versions and compare to clamped ones and expect perf hit to be max 30%
+// run_benchmarks.sh compares times of the unclamped and clamped versions and expects perf hit to be max 30%
 
 // RUN: clang -target spir -S -c $TEST_SRC -O0 -emit-llvm -S -o $OUT_FILE.O0.ll &&
 // RUN: echo "Running and verifying 'Formantic Synthesis by Double Amplitude Modulation' case" &&
@@ -29,9 +29,9 @@
 // RUN: opt -S -O3 $OUT_FILE.O0.clamped.ll -o $OUT_FILE.O0.clamped.O3.ll &&
 // RUN: opt -S -O3 $OUT_FILE.O3.clamped.ll -o $OUT_FILE.O3.clamped.O3.ll &&
 // RUN: echo "Running original.O0:" &&
-// RUN: (BENCHMARK=1 $RUN_KERNEL $OUT_FILE.O0.ll test_kernel 1 "(int,{0}):(int,1)") && 
+// RUN: (BENCHMARK=1 $RUN_KERNEL $OUT_FILE.O0.ll test_kernel 1 "(int,{0})") && 
 // RUN: echo "Running original.O3:" &&
-// RUN: (BENCHMARK=1 $RUN_KERNEL $OUT_FILE.O3.ll test_kernel 1 "(int,{0}):(int,1)") && 
+// RUN: (BENCHMARK=1 $RUN_KERNEL $OUT_FILE.O3.ll test_kernel 1 "(int,{0})") && 
 // RUN: echo "Running O0.clamped:" &&
 // RUN: (BENCHMARK=1 $RUN_KERNEL $OUT_FILE.O0.clamped.ll test_kernel 1 "(int,{0}):(int,1)") &&
 // RUN: echo "Running O0.clamped.O3:" &&
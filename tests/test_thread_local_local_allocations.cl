@@ -0,0 +1,14 @@
+// RUN: echo "Testing that static local allocations can be made thread local." &&
+// RUN: $OCLANG $TEST_SRC -S -o $OUT_FILE.ll &&
+// RUN: opt -load $CLAMP_PLUGIN -clamp-pointers -S $OUT_FILE.ll -o $OUT_FILE.clamped.ll &&
+// RUN: if grep "@localAllocations = .*thread_local" $OUT_FILE.clamped.ll > /dev/null; then echo "Local allocations were thread local by default." && false; fi &&
+// RUN: opt -load $CLAMP_PLUGIN -clamp-pointers -clamp-pointers-thread-local-locals -S $OUT_FILE.ll -o $OUT_FILE.tls.clamped.ll &&
+// RUN: if ! grep "@localAllocations = .*thread_local" $OUT_FILE.tls.clamped.ll > /dev/null; then echo "Local allocations were not thread local." && false; fi
+
+__kernel void test_kernel(__global float* in, __global float* out) {
+  int i = get_local_id(0);
+  __local float tile[64];
+  tile[i] = in[get_global_id(0)];
+  barrier(CLK_LOCAL_MEM_FENCE);
+  out[get_global_id(0)] = tile[63 - i];
+}